@@ -6,7 +6,13 @@
  *  can handle malloc requests from multiple threads.
  *
  *  Syntax:
- *  malloc-test [ size [ iterations [ thread count ]]]  
+ *  malloc-test [ size [ iterations [ thread count [ batch ]]]]  
+ *
+ *  With a batch, each thread allocates batch objects at a time and frees
+ *  them in random order, so the free lists the next batch is allocated
+ *  from are scattered over the superblocks - the cold, dependent loads a
+ *  malloc/free pair in a loop never sees. One operation is still a
+ *  malloc/free pair.
  *
  */
 
@@ -34,11 +40,14 @@ void *dummy (unsigned);
 static unsigned long size = 512;
 static unsigned long iteration_count = 1;
 static unsigned int thread_count = 1;
+static unsigned long batch = 0;
 
 #include "ptbarrier.h"
+#include "perfcounters.h"
 #include "mtmm.h"
 
 pthread_barrier_t barrier;
+tPerfCounters * perfCounters;
 
 
 
@@ -52,6 +61,8 @@ main (int argc, char *argv[])
   /*          * Parse our arguments          */
   switch (argc)
     {
+    case 5:			/* and the batch for random order frees */
+      batch = atoi (argv[4]);
     case 4:			/* size, iteration count, and thread count were specified */
       thread_count = atoi (argv[3]);
       if (thread_count > MAX_THREADS)
@@ -68,10 +79,19 @@ main (int argc, char *argv[])
       return (1);
     }
 
+  if (batch > iteration_count)
+    batch = iteration_count;
+  if (batch)			/* whole rounds only, so the operation count is right */
+    iteration_count -= iteration_count % batch;
+
   printf ("Object size: %ld, Iterations: %ld, Threads: %u\n",
 	  size, iteration_count, thread_count);
+  if (batch) {
+    printf ("Batch: %ld, freed in random order\n", batch);
+  }
 
   executionTime = (double *) malloc (sizeof(double) * thread_count);
+  perfCounters = (tPerfCounters *) malloc (sizeof(tPerfCounters) * thread_count);
   pthread_barrier_init (&barrier, NULL, thread_count);
 
   /*          * Invoke the tests          */
@@ -107,6 +127,8 @@ main (int argc, char *argv[])
     stddev += diff * diff;
   }
   stddev = sqrt (stddev / (thread_count - 1));
+  /* one operation is a malloc/free pair */
+  perfCountersPrint (perfCounters, thread_count, (double) iteration_count * thread_count);
   if (thread_count > 1) {
     printf ("Average execution time = %f seconds, standard deviation = %f.\n", average, stddev);
   } else {
@@ -123,7 +145,26 @@ run_test (void * arg)
   register unsigned long total_iterations = iteration_count;
   int tid = *((int *) arg);
   struct timeval start, end, null, elapsed, adjusted;
+  tPerfCounters counters;
+  void ** objects = NULL;
+  unsigned long * order = NULL;
+  unsigned int seed = tid + 1;
+
+  if (batch) {
+    /* a random permutation of the batch, made outside the timed loop. Each round starts it at another place */
+    objects = (void **) malloc (sizeof(void *) * batch);
+    order = (unsigned long *) malloc (sizeof(unsigned long) * batch);
+    for (i = 0; i < batch; i++)
+      order[i] = i;
+    for (i = batch - 1; i > 0; i--) {
+      unsigned long j = rand_r (&seed) % (i + 1);
+      unsigned long t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+  }
 
+  perfCountersOpen (&counters);
   pthread_barrier_wait (&barrier);
 
 #if 0
@@ -154,15 +195,30 @@ run_test (void * arg)
 
   /* Run the real malloc test */ 
   gettimeofday (&start, NULL);
+  perfCountersStart (&counters);
 
-  for (i = 0; i < total_iterations; i++)
+  if (batch)
     {
-      register void *buf;
-
-      buf = malloc (request_size);
-      free (buf);
+      unsigned long round, j;
+
+      for (round = 0; round < total_iterations / batch; round++)
+	{
+	  for (j = 0; j < batch; j++)
+	    objects[j] = malloc (request_size);
+	  for (j = 0; j < batch; j++)
+	    free (objects[order[(j + round) % batch]]);
+	}
     }
+  else
+    for (i = 0; i < total_iterations; i++)
+      {
+	register void *buf;
+
+	buf = malloc (request_size);
+	free (buf);
+      }
 
+  perfCountersStop (&counters);
   gettimeofday (&end, NULL);
   elapsed.tv_sec = end.tv_sec - start.tv_sec;
   elapsed.tv_usec = end.tv_usec - start.tv_usec;
@@ -183,6 +239,10 @@ run_test (void * arg)
   pthread_barrier_wait (&barrier);
   unsigned int pt = tid;
   executionTime[pt % thread_count] = adjusted.tv_sec + adjusted.tv_usec / 1000000.0;
+  perfCountersClose (&counters);
+  perfCounters[pt % thread_count] = counters;
+  free (objects);
+  free (order);
   //  printf ("Thread %u adjusted timing: %d.%06d seconds for %d requests" " of %d bytes.\n", pt, adjusted.tv_sec, adjusted.tv_usec, total_iterations, request_size);
 
   return NULL;
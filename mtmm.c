@@ -9,8 +9,30 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/syscall.h>
 
+/* glibc 2.35 and later registers a restartable sequence area for every thread, which gives us the current cpu for free */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ
+/* On x86-64 the cpu caches are popped and pushed inside rseq critical sections - no atomics at all. Whoever works on a cache
+outside a section fences its cpu with membarrier first. Elsewhere a busy flag taken with an atomic exchange guards them */
+#if defined(__x86_64__) && defined(RSEQ_SIG) && __has_include(<linux/membarrier.h>)
+#include <stddef.h>
+#include <linux/membarrier.h>
+#define HAVE_RSEQ_SECTIONS
+#endif
+#endif
+#endif
+
+/* everything mtmm.h declares is exported from the shared library, which is built with -fvisibility=hidden */
+#pragma GCC visibility push(default)
 #include "mtmm.h"
+#pragma GCC visibility pop
+#include "mtmm_snapshot.h"
 
 #define _DEBUG_MODE 
 /* Note - must compile with -Wno-unused-value if debug mode off. Otherwise, get zillion warnings because of DBG macros create code with no effect */
@@ -27,13 +49,19 @@
 #endif
 
   
+/* The defines below are defaults. The numbers actually used are in s_config - see loadConfig and mtmm_mallopt */
 #define NUM_HEAPS			3
+#define MAX_HEAPS			64
 #define GLOBAL_HEAP			0
 /* log2(SUPERBLOCK_SIZE) */
 #define NUM_SIZE_CLASSES	17 /* 16 real size classes, +1 for 'any size' i.e. recycling completely empty superblocks*/	
 #define RECYCLED_CLASS		16 /* the 17th slot is for completely empty, recycled superblocks that don't yet belong to any size class */
+#define LENT_CLASS			(RECYCLED_CLASS + 1) /* marks superblocks an arena or an object cache took out of the heaps */
+#if RECYCLED_CLASS != MTMM_NUM_SIZE_CLASSES
+#error "mtmm.h resolves size classes inline - MTMM_NUM_SIZE_CLASSES must match"
+#endif
 
-/* threshold for using hoard. If memory requested is more than this, then just mmap and return pointer to user */
+/* threshold for using hoard. If memory requested is more than this, it comes from the medium tier or straight from mmap */
 #define HOARD_THRESHOLD_MEM_SIZE	(SUPERBLOCK_SIZE/2)		
 
 /* fullness threshold : actually defines 'how empty' a heap needs to be before one of its empty enough superblocks is moved to the global heap.
@@ -43,16 +71,126 @@ is number of empty enough superblocks.
 E.g. when f=1/4 and K=0, heap will move one of its superblocks that is less than 75% full if the heap's total memory in use is
 less than 75% of the total memory allocated to that heap. */
 #define FULLNESS_THRESHOLD_F			0.25
-#define SUPERBLOCK_EMPTY_THRESHHOLD_K	0						
-	
+#define SUPERBLOCK_EMPTY_THRESHHOLD_K	0
+
+/* Each heap tunes its own f and K between the configured values and these bounds. Every EMPTINESS_ADAPT_PERIOD mallocs and frees on
+the heap it counts round trips - superblocks that went to the global heap and came back. At EMPTINESS_THRASH_ROUND_TRIPS or more
+the heap holds on to more memory (K and f up). When the heap winds down - no round trips and EMPTINESS_WINDDOWN_RATIO times more
+frees than mallocs - it goes back towards the configured values, so heaps that go idle still give their memory back */
+#define FULLNESS_THRESHOLD_F_MAX		0.5
+#define SUPERBLOCK_EMPTY_THRESHHOLD_K_MAX	8
+#define EMPTINESS_ADAPT_PERIOD			256
+#define EMPTINESS_THRASH_ROUND_TRIPS	4
+#define EMPTINESS_WINDDOWN_RATIO		2
+#define FULLNESS_THRESHOLD_F_STEP		0.05
+
+/* Superblocks are not mapped one by one, they are carved out of bigger regions. A region is exactly one huge page,
+so when huge pages are enabled a region is backed by a single TLB entry and is purged (returned to the OS) as a whole */
+#define HUGEPAGE_SIZE			(2*1024*1024)
+#define REGION_ORDER			21
+#define REGION_SIZE				HUGEPAGE_SIZE
+
+/* Each size class has its own superblock span: the smallest power of two that holds MIN_BLOCKS_PER_SUPERBLOCK blocks, but no less
+than 1 << MIN_SPAN_ORDER. Small classes don't tie up a whole SUPERBLOCK_SIZE for a handful of objects, and big classes get enough blocks
+for the fullness accounting to mean something. A region only holds superblocks of one span, so they pack without gaps */
+#define MIN_BLOCKS_PER_SUPERBLOCK	8
+#define MIN_SPAN_ORDER			13		/* 8KB */
+#define NUM_SPAN_ORDERS			(REGION_ORDER - MIN_SPAN_ORDER + 1)
+#define SUPERBLOCKS_PER_REGION	(REGION_SIZE >> MIN_SPAN_ORDER)	/* with the smallest span */
+#define MAX_REGIONS				65536	/* 128GB of superblocks. Superblock indexes must fit in 32 bits */
+
+/* Arenas bump allocate out of whole superblocks of ARENA_SPAN_ORDER (or the smallest span, if that is bigger) taken out of the heaps.
+Objects bigger than a quarter of the span come from malloc instead, so at most a quarter of a superblock is lost at its end */
+#define ARENA_SPAN_ORDER		16		/* 64KB */
+#define ARENA_ALIGNMENT			16		/* objects this size and bigger are aligned to this, smaller ones to their size rounded up to a power of two */
+
+/* Object caches hand out objects of one size, packed back to back in whole superblocks of at least OBJECT_CACHE_SPAN_ORDER with no block
+header. A free object is never written to, so it keeps its constructed state. Each thread has a magazine - a stack of free objects - for
+every cache it uses, and trades full and empty ones with the cache's depot */
+#define MAX_OBJECT_CACHES		64
+#define OBJECT_CACHE_SPAN_ORDER	16		/* 64KB */
+#define OBJECT_CACHE_MAX_SIZE	(REGION_SIZE / 8)
+#define MAGAZINE_SIZE			32
+
+/* opt-in huge page mode. Either compile with -DUSE_HUGEPAGES=1 or run with MTMM_HUGEPAGES=1 in the environment */
+#ifndef USE_HUGEPAGES
+#define USE_HUGEPAGES			0
+#endif
+
+/* Medium objects - from HOARD_THRESHOLD_MEM_SIZE up to MEDIUM_MAX_SIZE - come from a buddy allocator working on MEDIUM_CHUNK_SIZE
+aligned chunks. Blocks are powers of two from 32KB to half a chunk, header included. Only bigger objects get their own mmap */
+#define MEDIUM_MIN_ORDER		15												/* log2 of the smallest medium block */
+#define MEDIUM_CHUNK_ORDER		21												/* log2(MEDIUM_CHUNK_SIZE) */
+#define MEDIUM_CHUNK_SIZE		(1UL << MEDIUM_CHUNK_ORDER)
+#define NUM_MEDIUM_ORDERS		(MEDIUM_CHUNK_ORDER - MEDIUM_MIN_ORDER + 1)
+#define MEDIUM_UNITS			(1U << (MEDIUM_CHUNK_ORDER - MEDIUM_MIN_ORDER))	/* smallest blocks per chunk - at most 64, a bit each */
+#define MEDIUM_MAX_SIZE			(MEDIUM_CHUNK_SIZE/2 - sizeof(tBlockHeader))	/* largest user size served by the medium tier */
+#define MAX_EMPTY_MEDIUM_CHUNKS	1												/* completely free chunks a heap keeps for itself */
+#define MMAP_THRESHOLD_MEM_SIZE	(MEDIUM_MAX_SIZE + 1)							/* from this size on objects get their own mmap */
+
+/* Per-CPU caches of free blocks sit in front of the heaps. Blocks in a cpu cache still count as in use in their heap */
+#define MAX_CPUS				256		/* threads running on higher cpu numbers just use the heaps */
+#define CPU_CACHE_SIZE			32		/* blocks cached per cpu per size class */
+#define CPU_CACHE_BATCH			(CPU_CACHE_SIZE/2)	/* blocks moved between a cpu cache and the heaps at a time */
+#define CPU_CACHE_LOW_WATER		(CPU_CACHE_BATCH/4)	/* below this the maintenance thread tops the cache up again */
+
+/* A free list is a chain of dependent loads, and after frees in random order the next block is cold. Whatever is popped
+next - the new head of a free list, the next block in a cpu cache, the next superblock of a list - is prefetched for
+writing while the current one is handed out */
+#define PREFETCH_FOR_WRITE(p)	__builtin_prefetch((p), 1, 3)
+
+/* On a NUMA machine the heaps are split between the nodes, and a thread takes a heap of the node it runs on. Every region and medium
+chunk belongs to a node - its memory is bound there - and each node has a global heap of its own, so superblocks only move to another
+node when there is no memory left on their own. The topology comes from sysfs, or from MTMM_NUMA for testing. With one node, or fewer
+heaps than nodes, everything is on node 0 */
+#define MAX_NODES				8
+#define NODE_SYSFS_PATH			"/sys/devices/system/node/node%u/cpulist"
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED			1
+#endif
+
+/* The maintenance thread is off unless a tick length is configured (MTMM_OPT_MAINTENANCE_MS). When it runs, frees only leave
+a hint on the heap and the thread does the emptiness invariant work, purges empty superblocks and tops up cpu caches */
+#define MAINTENANCE_MS				0
+#define MAINTENANCE_DECAY_TICKS		4	/* ticks an empty superblock stays in the global heap before its memory is purged */
+#define MAINTENANCE_IDLE_TICKS		4	/* ticks without mallocs or frees before a heap counts as idle */
+#define PRESSURE_RELIEF_STEP		REGION_SIZE	/* growth over the soft limit between two reliefs */
+
+/* A thread stays on its heap until it keeps finding it locked by other threads. Every HEAP_REBALANCE_PERIOD trips to its heap
+the thread checks how many of them were contended, and if at least HEAP_MIGRATE_CONTENTION were, it moves to the least loaded heap */
+#define HEAP_REBALANCE_PERIOD	64
+#define HEAP_MIGRATE_CONTENTION	8
+
+/* A heap that runs dry is refilled with a batch of superblocks of the class at once. The batch doubles while the heap keeps using
+up all it got (a thread ramping up), and halves while most mallocs are served by blocks freed in the meantime (steady state) or when
+the heap gave away what it got before using it */
+#define MAX_REFILL_BATCH		8
+#define REFILL_GROW_RATIO		2		/* grow if less than this many times the last refill was allocated since */
+#define REFILL_SHRINK_RATIO		8		/* shrink if more than this many times the last refill was allocated since */
+
+/* block states (tBlockHeader.inUse) */
+#define BLOCK_FREE				0
+#define BLOCK_IN_USE			1
+#define BLOCK_CACHED			2		/* freed by the user but parked in a cpu cache */
+#define BLOCK_ALIGNED			3		/* the header of an aligned object inside a bigger block, see allocAligned */
+
+/* Headers are 32 bytes and superblocks, medium blocks and large chunks start at least 32 byte aligned. So a block of a size class
+is aligned to its size up to BLOCK_ALIGNMENT, and medium and large blocks to BLOCK_ALIGNMENT */
+#define BLOCK_ALIGNMENT			32
 
 /* header of memory block */ 
 typedef struct sBlockHeader
 {
-	unsigned int		inUse;							/* 1 if block is allocated to user, otherwise 0 */
+	unsigned int		inUse;							/* BLOCK_IN_USE if block is allocated to user, BLOCK_CACHED if in a cpu cache, otherwise BLOCK_FREE */
+	unsigned int		requestedSize;					/* small blocks: what malloc was asked for. Only mtmm_snapshot looks at it */
 	size_t				size;							/* size of allocated memory as available for user */
-	struct sBlockHeader	*pNextFree;						/* pointer to next free block in linked list of free blocks. Only relevant if not in use. */
-	struct sSuperblock	*pMySuperblock;					/* pointer back to superblock that contains this block */
+	union
+	{
+		struct sBlockHeader	*pNextFree;					/* pointer to next free block in linked list of free blocks. Only relevant if not in use. */
+		struct sMediumChunk	*pMyChunk;					/* medium blocks: the chunk that contains this block. NULL for large chunks */
+		struct sBlockHeader	*pAlignedFrom;				/* BLOCK_ALIGNED: the header of the block the aligned object is in */
+	};
+	struct sSuperblock	*pMySuperblock;					/* pointer back to superblock that contains this block. NULL for medium and large blocks */
 } tBlockHeader;
 
 typedef struct sSuperblock
@@ -62,21 +200,91 @@ typedef struct sSuperblock
 	unsigned int		sizeClass; 						/* 0-16 - size class 16 is the recycled class - can be any size */
 	size_t				blockSize;						/* calculate only once on initialization */
 	unsigned int		ownerHeap;						/* index into the heap array to the heap this superblock belongs to */
-	unsigned int 		numBlocks; 						/* up to SUPERBLOCK_SIZE/blockSize. Calculated upon creation. */
+	unsigned int 		numBlocks; 						/* up to span/blockSize. Calculated upon creation. */
 	tBlockHeader		*pBlockArray;					/* mmap space needed according to num blocks - depends on class size */
 	unsigned int		numFreeBlocks;					/* keep track of number of free blocks	*/
 	tBlockHeader		*pFreeBlocksHead;				/* pointer to LIFO linked list of free blocks. */
+	struct sRegion		*pRegion;						/* region this superblock was carved from */
+	unsigned int		spanOrder;						/* log2 of the superblock size - fixed by the region it was carved from */
+	unsigned int		index;							/* 1 based, unique for the life of the process. Used instead of a pointer in the global heap stacks */
+	unsigned int		nextInStack;					/* index of the superblock below this one in a global heap stack, 0 at the bottom */
+	pthread_mutex_t		mutex;							/* protects the blocks while the global heap owns the superblock */
+	unsigned int		isIdle;							/* 1 while in the global heap's empty pool. Protected by the region mutex, like the two below */
+	unsigned int		isPurged;						/* 1 if its memory went back to the OS, by itself or with its region */
+	unsigned long		idleSince;						/* maintenance tick it became idle */
 }tSuperblock;
 
+/* A REGION_SIZE aligned chunk of memory from the OS, sliced into superblocks of one span.
+The superblock descriptors live here and not inside the region memory, so the region memory can be purged without losing them */
+typedef struct sRegion
+{
+	struct sRegion		*pNext;							/* all regions ever mapped, newest first */
+	void				*pBase;							/* REGION_SIZE aligned start of the superblock memory */
+	unsigned int		index;							/* position in the region table */
+	unsigned int		spanOrder;						/* log2 of the size of every superblock in this region */
+	unsigned int		node;							/* NUMA node the memory is bound to, and the global heap its idle superblocks go to */
+	unsigned int		numSuperblocks;					/* REGION_SIZE >> spanOrder */
+	unsigned int		numCarved;						/* superblocks handed out so far. Carving is sequential so superblocks stay packed */
+	unsigned int		numIdle;						/* completely empty superblocks parked in the global heap */
+	unsigned int		isHuge;							/* 1 if the region is backed by a huge page */
+	unsigned int		isPurged;						/* 1 if the region memory was given back to the OS. It faults back in (zeroed) on reuse */
+	size_t				purgedBytes;					/* how much of the region is purged and doesn't count in the footprint */
+	tSuperblock			superblocks[SUPERBLOCKS_PER_REGION];
+} tRegion;
+
+/* A MEDIUM_CHUNK_SIZE aligned chunk managed as a buddy system. Free blocks are kept in bitmaps - bit u of freeMap[o] is set if a free
+block of order MEDIUM_MIN_ORDER+o starts at unit u - so free memory is never written to and can be purged. The order of a block
+in use is known from its header size */
+typedef struct sMediumChunk
+{
+	struct sMediumChunk	*pPrev;							/* chunk is a node in its heap's list, or in the list of free chunks */
+	struct sMediumChunk	*pNext;
+	void				*pBase;							/* MEDIUM_CHUNK_SIZE aligned start of the chunk memory */
+	unsigned int		ownerHeap;						/* only changes while the chunk is completely free */
+	unsigned int		node;							/* NUMA node the memory is bound to */
+	unsigned int		numFreeUnits;					/* free memory in units of the smallest block */
+	uint64_t			freeMap[NUM_MEDIUM_ORDERS];
+} tMediumChunk;
+
 /* A collection of superblocks. Each superblock is divided into blocks of equal size, each equalling this class's size */
 typedef struct sSizeClass
 {
 	unsigned int		size;							/* class size: 0 if superblock completely empty and not yet classified. otherwise ranges from 2^0 to 2^15 */
 	tSuperblock			*pHead;							/* superblocks ordered from most full to least full */
 	tSuperblock			*pTail;	
+	tSuperblock			*pFirstWithFree;				/* the first superblock with a free block. All before it are full */
 	pthread_mutex_t		mutex;							/* lock mechanism for the size class */
+	unsigned int		refillBatch;					/* superblocks taken at the last refill, 0 if the class was never refilled */
+	size_t				numAllocatedSinceRefill;		/* blocks handed out from this class since the last refill */
 }tSizeClass;
 
+/* Lock-free (Treiber) stack of superblocks. The top word holds the index of the top superblock in the low 32 bits and a
+generation count in the high 32 bits - the count changes on every push and pop, so a compare-and-swap can't succeed on a
+stale top that happens to hold the same superblock again (ABA) */
+typedef struct sSuperblockStack
+{
+	uint64_t			top;
+} __attribute__((aligned(64))) tSuperblockStack;
+
+/* free blocks of every size class owned by one cpu. busy is held only for the length of one refill or flush - or of every push and
+pop without rseq sections. A thread that finds it taken (the holder was preempted or migrated in the middle) doesn't wait, it goes
+to the heap instead */
+typedef struct sCpuCache
+{
+	int					busy;
+	unsigned int		lowWater;								/* hint for the maintenance thread - bit for each class that ran low */
+	unsigned int		numBlocks[RECYCLED_CLASS];				/* one stack for each real size class */
+	tBlockHeader		*pBlocks[RECYCLED_CLASS][CPU_CACHE_SIZE];
+} __attribute__((aligned(64))) tCpuCache;
+
+/* blocks of one size class out of their superblocks, in any heap - handed out or parked in cpu caches. Counted where blocks leave
+and come back to superblocks, not on the cpu cache fast path. The peak goes into snapshots for mtmm_analyze -r */
+typedef struct sClassCount
+{
+	unsigned long		numBlocksOut;
+	unsigned long		peakBlocksOut;
+} __attribute__((aligned(64))) tClassCount;
+
 /* represents one heap - one thread */
 typedef struct sHeap
 {
@@ -84,17 +292,164 @@ typedef struct sHeap
 	size_t				statMemoryHeld;					/* The amount of memory held in this heap that was allocated from the operating system */
 	tSizeClass			sizeClasses[NUM_SIZE_CLASSES]; 	/* hold size classes for all sizes from 1 to log2(SUPERBLOCK_SIZE) plus one for completely empty s.blocks */	
 	pthread_mutex_t		mutex;							/* lock mechanism for the heap that this size class belongs to */
+	tMediumChunk		*pMediumChunks;					/* chunks of the medium tier, oldest first */
+	unsigned int		numEmptyMediumChunks;			/* completely free ones among them */
+	unsigned int		numThreads;						/* threads currently assigned to this heap */
+	unsigned long		numContended;					/* times a thread had to wait for this heap's lock */
+	double				fullnessF;						/* this heap's f and K, see adaptEmptinessThreshold */
+	unsigned int		emptyThresholdK;
+	unsigned long		numMallocs;						/* slow path mallocs and frees done on this heap */
+	unsigned long		numFrees;
+	unsigned long		numToGlobal;					/* superblocks given to the global heap. For the global heap - received from all heaps */
+	unsigned long		numFromGlobal;					/* superblocks taken from the global heap. For the global heap - handed out to all heaps */
+	unsigned long		adaptMallocs;					/* the counters above when f and K were last adapted */
+	unsigned long		adaptFrees;
+	unsigned long		adaptToGlobal;
+	unsigned long		adaptFromGlobal;
+	int					needsMaintenance;				/* hint left by frees for the maintenance thread */
+	unsigned long		maintenanceOps;					/* numMallocs + numFrees at the last maintenance tick */
+	unsigned int		idleTicks;						/* maintenance ticks in a row without mallocs or frees */
 } tHeap;
 
 /* the hoard algorithm uses one heap per thread plus one more for a 'global' heap */
 typedef struct sHoard
 {
-	tHeap				heapArray[NUM_HEAPS];
+	tHeap				heapArray[MAX_HEAPS];			/* only the first s_config.numHeaps are used */
+	tRegion				*pRegions;						/* list of regions, newest first */
+	tRegion				*pCarveRegions[MAX_NODES][NUM_SPAN_ORDERS];	/* the region currently being carved, for each node and span */
+	tRegion				*pRegionTable[MAX_REGIONS];		/* region by index, to find superblocks by index */
+	unsigned int		numRegions;
+	tSuperblockStack	globalStacks[MAX_NODES][RECYCLED_CLASS];	/* the global heap of each node: superblocks by size class, and completely
+															empty ones by span. heapArray[GLOBAL_HEAP] keeps the statistics of all of them */
+	tSuperblockStack	emptyStacks[MAX_NODES][NUM_SPAN_ORDERS];
+	unsigned int		spanOrders[RECYCLED_CLASS];		/* superblock span of each size class */
+	unsigned int		numNodes;						/* 1 unless the heaps are split between NUMA nodes */
+	unsigned int		nodeIds[MAX_NODES];				/* the kernel's number of each node, for mbind */
+	unsigned char		cpuNodes[MAX_CPUS];				/* node of each cpu */
+	unsigned char		heapNodes[MAX_HEAPS];			/* node of each heap. The heaps of a node are numbered consecutively */
+	unsigned int		firstNodeHeap[MAX_NODES];
+	unsigned int		numNodeHeaps[MAX_NODES];
+	pthread_mutex_t		regionMutex;					/* regions are shared by all heaps */
+	tMediumChunk		*pFreeMediumChunks;				/* purged medium chunks no heap holds. Protected by the region mutex */
+	int					useHugepages;					/* back regions with huge pages */
+	int					useCpuCaches;					/* 0 if the kernel or libc didn't register rseq for us */
+	int					useRseqSections;				/* cpu caches are popped and pushed in rseq critical sections, see popCpuCache */
+	size_t				pageSize;
+	unsigned long		maintenanceTicks;				/* times the maintenance thread woke up */
+	pthread_key_t		threadKey;						/* its destructor releases the heap of an exiting thread */
+	tMtmmCache			*pObjectCaches[MAX_OBJECT_CACHES];
+	unsigned long		numMediumChunks;				/* medium chunks ever mapped. They are purged but never unmapped */
+	unsigned long		numLargeChunks;					/* large chunks mapped right now, and their size */
+	size_t				largeChunkBytes;
+	size_t				footprint;						/* memory mapped from the OS and not purged - what the budget limits */
+	int					underPressure;					/* the footprint went over the soft limit since the last relief */
+	size_t				pressureMark;					/* and has to grow to this before the next relief. 0 after a relief that got it under */
+	void				(*pPressureCallback)(int level, size_t footprint);
+	unsigned int		numObjectCaches;				/* may count past MAX_OBJECT_CACHES - the extra caches were never created */
+	tCpuCache			cpuCaches[MAX_CPUS];
+	tClassCount			classCounts[RECYCLED_CLASS];
 }tHoard;
 
+/* an arena of mtmm.h. Not thread safe - one thread uses it at a time */
+struct sMtmmArena
+{
+	tSuperblock			*pSuperblocks;					/* linked through pNext, the one being carved first */
+	char				*pNextFree;						/* bump pointer into the first superblock */
+	char				*pEnd;
+	void				*pLargeObjects;					/* objects from malloc, linked through their first word */
+	unsigned int		spanOrder;
+};
+
+/* a stack of free objects of one object cache. Allocated with malloc */
+typedef struct sMagazine
+{
+	struct sMagazine	*pNext;							/* in the cache's depot */
+	unsigned int		numObjects;
+	void				*pObjects[MAGAZINE_SIZE];
+} tMagazine;
+
+/* an object cache of mtmm.h. It keeps its superblocks for the life of the process */
+struct sMtmmCache
+{
+	pthread_mutex_t		mutex;							/* protects the depot and the carving */
+	unsigned int		index;							/* of the cache's magazine in every thread's t_pMagazines */
+	size_t				objSize;						/* rounded up to the alignment */
+	unsigned int		spanOrder;
+	void				(*ctor)(void *);
+	tMagazine			*pFullMagazines;				/* the depot - magazines with objects in them, and empty ones */
+	tMagazine			*pEmptyMagazines;
+	void				*pStrayObjects;					/* freed when no magazine could be had, linked through their first word */
+	char				*pNextFree;						/* the objects not handed out yet of the superblock being carved */
+	char				*pEnd;
+};
+
+/* tuning parameters. Fixed once the first allocation is done */
+typedef struct sConfig
+{
+	unsigned int		isLoaded;						/* MTMM_CONF was read */
+	unsigned int		numHeaps;						/* including the global heap */
+	double				fullnessF;
+	unsigned int		emptyThresholdK;
+	double				fullnessFMax;					/* bounds for the heaps' own f and K. Equal to f and K turns tuning off */
+	unsigned int		emptyThresholdKMax;
+	size_t				hoardThreshold;					/* smaller objects come from the superblocks */
+	size_t				mmapThreshold;					/* objects from hoardThreshold up to this come from the medium tier, this and bigger from mmap */
+	unsigned int		minSpanOrder;
+	unsigned int		minBlocksPerSuperblock;
+	unsigned int		maintenanceMs;					/* tick of the maintenance thread, 0 for no maintenance thread */
+	size_t				softLimit;						/* the memory budget, 0 for none. Unlike the rest, mtmm_set_budget changes */
+	size_t				hardLimit;						/* them at any time */
+} tConfig;
+
 /* Heaps are defined as a static array in the heap - reside in the data segment */
 static tHoard		s_hoard;	
 
+static tConfig		s_config =
+{
+	0,
+	NUM_HEAPS,
+	FULLNESS_THRESHOLD_F,
+	SUPERBLOCK_EMPTY_THRESHHOLD_K,
+	FULLNESS_THRESHOLD_F_MAX,
+	SUPERBLOCK_EMPTY_THRESHHOLD_K_MAX,
+	HOARD_THRESHOLD_MEM_SIZE,
+	MMAP_THRESHOLD_MEM_SIZE,
+	MIN_SPAN_ORDER,
+	MIN_BLOCKS_PER_SUPERBLOCK,
+	MAINTENANCE_MS,
+	0,
+	0
+};
+
+/* names of the tuning parameters in MTMM_CONF */
+static const struct
+{
+	const char			*pName;
+	int					param;
+} s_configNames[] =
+{
+	{"heaps",		MTMM_OPT_HEAPS},
+	{"f",			MTMM_OPT_FULLNESS_F},
+	{"k",			MTMM_OPT_EMPTY_K},
+	{"fmax",		MTMM_OPT_FULLNESS_F_MAX},
+	{"kmax",		MTMM_OPT_EMPTY_K_MAX},
+	{"threshold",	MTMM_OPT_HOARD_THRESHOLD},
+	{"mmap",		MTMM_OPT_MMAP_THRESHOLD},
+	{"sbmin",		MTMM_OPT_SUPERBLOCK_MIN},
+	{"sbobjs",		MTMM_OPT_SUPERBLOCK_OBJECTS},
+	{"bg",			MTMM_OPT_MAINTENANCE_MS},
+	{"soft",		MTMM_OPT_SOFT_LIMIT},
+	{"hard",		MTMM_OPT_HARD_LIMIT},
+};
+
+/* the heap the current thread is assigned to, or -1 before its first allocation. Sticky until contention moves it */
+static __thread int				t_heapNum = -1;
+static __thread unsigned int	t_heapOps;				/* trips to the heap since the last rebalance check */
+static __thread unsigned int	t_heapContention;		/* how many of them found the heap locked */
+static __thread tMagazine		*t_pMagazines[MAX_OBJECT_CACHES];	/* loaded magazine of each object cache */
+static __thread int				t_overBudget;			/* the thread's current allocation was refused by the hard limit */
+static __thread int				t_budgetRetry;			/* retrying that allocation - don't retry again */
+
 #ifdef DEBUG_MODE
 /* Function to print out contents of hoard heaps */
 static void dumpHoard(char *title);
@@ -106,26 +461,140 @@ static void *	allocateLargeMemoryChunk(size_t	sz);
 /* Deallocate memory that was previously allocated from OS  */
 static void		deallocateLargeMemoryChunk(void * ptr, size_t sz);
 
-/* Gets an index into the heap array based on the current thread's processor id */
+/* Read the tuning parameters from MTMM_CONF. Only the first call does anything */
+static void		loadConfig(void);
+
+/* Set one tuning parameter after checking it. Returns 1 on success, 0 if the parameter or the value is not valid */
+static int		setConfig(int param, double value);
+
+/* read a number of MTMM_CONF or MTMM_RESERVE, with an optional k or m suffix, and advance past it */
+static double	parseConfigValue(const char **ppConf);
+
+/* reserve the superblocks listed in MTMM_RESERVE. Runs once the heaps are set up */
+static void		loadReserveProfile(void);
+
+/* Allocate a medium block from the current thread's heap */
+static void *	allocMediumBlock(size_t sz);
+
+/* log2 of the buddy block a medium object of sz bytes takes, header included */
+static unsigned int	getMediumOrder(size_t sz);
+
+/* what is mapped for a large object of sz bytes, header included - whole pages. 0 if that overflows */
+static size_t	getLargeMapSize(size_t sz);
+
+/* Return a medium block to its chunk, coalescing it with its free buddies */
+static void		freeMediumBlock(tBlockHeader *pBlockHeader);
+
+/* Take a block of the given order from a chunk. The caller holds the owner heap's lock. NULL if the chunk has no block big enough */
+static void *	allocFromMediumChunk(tMediumChunk *pChunk, unsigned int order);
+
+/* Get a completely free chunk for a heap - a purged one if there is any, otherwise a new one from the OS */
+static tMediumChunk *	createMediumChunk(unsigned int heapNum);
+
+/* Take a completely free chunk out of its heap, purge it and put it on the list of free chunks. The caller holds the heap lock */
+static void		releaseMediumChunk(tHeap *pHeap, tMediumChunk *pChunk);
+
+/* Map size bytes aligned to size, backed by huge pages if enabled */
+static void *	mapAlignedMemory(size_t size, unsigned int *pIsHuge);
+
+/* Gets an index into the heap array for the current thread. Hashed from the thread id on first use, then sticky */
 static int		getHeapNumber(unsigned int *pHeapNumber);
 
+/* move the current thread to the heap with the fewest threads on the node it runs on */
+static void		migrateHeap(void);
+
+/* find the NUMA nodes and split the heaps between them. Called once from initHoard */
+static void		loadTopology(void);
+
+/* mark the ids in a list like 0-3,8,10-11 that are below maxId. Returns where the list ends */
+static const char *	parseIdList(const char *pList, unsigned char *pIsListed, unsigned int maxId);
+
+/* the node the current thread runs on - 0 if not known */
+static unsigned int	getCurrentNode(void);
+
+/* the node of the calling thread's heap */
+static unsigned int	getThreadNode(void);
+
+/* have the memory faulted in on the given node */
+static void		bindToNode(void *p, size_t size, unsigned int node);
+
+/* the global heap stacks of a superblock's node - where it goes when its heap gives it up */
+static tSuperblockStack *	getGlobalStack(tSuperblock *pSuperblock, unsigned int sizeClass);
+static tSuperblockStack *	getEmptyStack(tSuperblock *pSuperblock);
+
+/* a superblock of the size class or an empty one from the global heap of any node but the given one. NULL if there is none */
+static tSuperblock *	popRemoteSuperblock(unsigned int node, unsigned int sizeClass);
+
+/* thread exit destructor. The last thread to leave a heap hands the heap's memory to the global heap */
+static void		releaseThreadHeap(void *pArg);
+
+/* Gets the cpu the current thread runs on from its rseq area. Returns 0 if not known */
+static int		getCpuNumber(unsigned int *pCpuNumber);
+
+/* pop a block of the given size class from the current cpu's cache, refilling the cache from the heap if it ran dry. NULL if no cache to use */
+static void *	allocFromCpuCache(unsigned int sizeClass);
+
+#ifdef HAVE_RSEQ_SECTIONS
+/* pop a block off the current cpu's cache in an rseq critical section. NULL if the cache is empty or busy */
+static tBlockHeader *	popCpuCache(unsigned int sizeClass, tCpuCache **ppCache, unsigned int *pNumLeft);
+
+/* push a block on the current cpu's cache in an rseq critical section. 0 if the cache is full or busy */
+static int		pushCpuCache(tBlockHeader *pBlockHeader, unsigned int sizeClass);
+#endif
+
+/* push a freed block of the given size class on the current cpu's cache, flushing part of the cache to the heaps if it is full.
+Returns 0 if no cache to use */
+static int		freeToCpuCache(tBlockHeader *pBlockHeader, unsigned int sizeClass);
+
+/* return a block to its superblock in the owning heap - the slow part of free */
+static void		freeBlock(tBlockHeader *pBlockHeader);
+
+/* return a block to a superblock the global heap owns. Returns 0 if the global heap no longer owns it */
+static int		freeBlockToGlobal(tBlockHeader *pBlockHeader);
+
+/* count blocks of a size class taken out of superblocks (num > 0) or put back (num < 0), and keep the peak */
+static void		countBlocksOut(unsigned int sizeClass, long num);
+
 /* Get size class by rounding up requested size to next highest power of 2, return that power. */
 static int		getSizeClass    (size_t	requestedSize, unsigned int *pNextPowerOfTwo);
 
-/* Allocate memory (memmap) for the superblock */
-static tSuperblock	*	createSuperblock(unsigned int heapNum, unsigned int sizeClass);
+/* log2 of the superblock size for a size class */
+static unsigned int	getSpanOrder(unsigned int sizeClass);
+
+/* Carve up to numSuperblocks new superblocks for a heap and size class. Returns how many were created */
+static unsigned int	createSuperblocks(unsigned int heapNum, unsigned int sizeClass, tSuperblock **ppSuperblocks, unsigned int numSuperblocks);
+
+/* Map a new REGION_SIZE aligned region from the OS on the given node, backed by huge pages if enabled */
+static tRegion *	createRegion(unsigned int node);
+
+/* Take the next unused superblocks of a span from the node's current region, mapping new regions as they are used up. Returns how many were carved */
+static unsigned int	carveSuperblocks(unsigned int node, unsigned int spanOrder, tSuperblock **ppSuperblocks, unsigned int numSuperblocks);
+
+/* Book keeping for completely empty superblocks parked in the global heap's empty pool. When a whole region is idle it is purged */
+static void		markSuperblockIdle(tSuperblock *pSuperblock);
+static int		markSuperblockBusy(tSuperblock *pSuperblock);
+
+/* pop a superblock off the empty pool of a node's global heap and mark it busy. NULL if there is none the budget allows */
+static tSuperblock *	popEmptySuperblock(unsigned int node, unsigned int spanOrder);
 
 /* Initialize the superblock for a given size class and heap */
 static void initSuperblock(unsigned int heapNum, unsigned int sizeClass, tSuperblock *pSuperblock);
  
-/* internal malloc function */ 
+/* internal malloc function. The caller holds the heap lock */ 
 static void * allocMem(unsigned int heapNum, unsigned int sizeClass);
 
-/* search for free block in given size class, return pointer to block if found, otherwise NULL. Update heap statistics */
-static void * allocFromFreeBlockInHeap(unsigned int heapNum, unsigned int sizeClass);
+/* search for free block in the given list of superblocks (a size class or the recycled class) for a block of the requested size class.
+return pointer to block if found, otherwise NULL. Update heap statistics */
+static void * allocFromFreeBlockInHeap(unsigned int heapNum, unsigned int listClass, unsigned int sizeClass);
+
+/* allocMem for up to count blocks at once, the headers go to ppBlocks. Returns how many were allocated. The caller holds the heap lock */
+static unsigned int	allocMemBatch(unsigned int heapNum, unsigned int sizeClass, tBlockHeader **ppBlocks, unsigned int count);
 
-/* create a new superblock, add to the given heap and size class, check emptiness invariant, update heap statistics, return pointer to requested block of memory */
-static void *allocFromFreeBlockInNewSuperblock(unsigned int heapNum, unsigned int sizeClass);
+/* how many superblocks to refill a heap's size class with, from the memory allocated from it since its last refill */
+static unsigned int getRefillBatch(unsigned int heapNum, unsigned int sizeClass);
+
+/* create new superblocks, add them to the given heap and size class, update heap statistics. Returns the first one, NULL if none could be created */
+static tSuperblock *addNewSuperblocks(unsigned int heapNum, unsigned int sizeClass, unsigned int numSuperblocks);
 
 /* memory to add to 'memory held' statistic in given heap. Memory to add may be negative. */
 static void updateMemoryHeld(unsigned int heapNum, int memoryToAdd);
@@ -139,8 +608,18 @@ static int isEmptyEnough(unsigned int heapNum);
 /* return the superblock that is empty enough to be moved to the global heap  */
 static tSuperblock *findEmptyEnoughSuperblock(unsigned int heapNum);
 
-/* move superblock from one heap to the other, update statistics ...*/
-static void moveSuperblockFromTo(unsigned int fromHeap, unsigned int toHeap, tSuperblock *pSuperblock);
+/* give a superblock of the given heap to the global heap, update statistics. The caller holds the heap lock */
+static void moveSuperblockToGlobal(unsigned int heapNum, tSuperblock *pSuperblock);
+
+/* take a superblock popped off a global heap stack into the given heap, update statistics. The caller holds the heap lock */
+static void moveSuperblockFromGlobal(unsigned int heapNum, tSuperblock *pSuperblock);
+
+/* lock-free push and pop on the global heap stacks */
+static void			pushGlobalSuperblock(tSuperblockStack *pStack, tSuperblock *pSuperblock);
+static tSuperblock *	popGlobalSuperblock(tSuperblockStack *pStack);
+
+/* superblock by its index */
+static tSuperblock *	getSuperblockByIndex(unsigned int index);
 
 /* add superblock to the sorted-from-fullest-to-emptiest list of superblocks for the given size class and heap */
 static void addSuperblockToClass(unsigned int heapNum, unsigned int sizeClass, tSuperblock *pSuperblock);
@@ -154,20 +633,110 @@ static void reorderSuperblockInClass(unsigned int heapNum, unsigned int sizeClas
 /* allocate one block of memory from the given superblock */
 void * allocBlock(tSuperblock *pSuperblock, unsigned int requestedSizeClass);
 
+/* pop up to count blocks off the free list of a superblock of a real size class, the headers go to ppBlocks. Returns how many */
+static unsigned int	allocBlocks(tSuperblock *pSuperblock, tBlockHeader **ppBlocks, unsigned int count);
+
+/* 0 for a full superblock, 1 for one with free blocks, 2 for a completely empty one - the order of a size class list */
+static unsigned int	getFullnessTier(tSuperblock *pSuperblock);
+
 /* Recycle completely empty superblocks to be used by any size class */
 static void recycleSuperblock(unsigned int heapNum, unsigned int newSizeClass, tSuperblock *pSuperblock);
 
-/* check if the heap is too empty and move f-empty superblocks out to global heap */
+/* check if the heap is too empty and move f-empty superblocks out to global heap. The caller holds the heap lock */
 static void checkInvariantAndMoveSuperblocks(unsigned int heapNum);
 
-/* special self initialising malloc - to be run only once! */
+/* raise or lower the heap's f and K from the superblock round trips it made to the global heap lately. The caller holds the heap lock */
+static void adaptEmptinessThreshold(unsigned int heapNum);
+
+/* the background maintenance thread, and what it does on every tick */
+static void *	maintenanceThread(void *pArg);
+static void		maintainHeaps(void);
+static unsigned int	maintainRegions(unsigned long decayTicks);
+static void		refillCpuCaches(void);
+
+/* take a completely empty superblock on the given node for an arena, an object cache or the reserve - out of the calling thread's heap,
+the global heap or a region. NULL if out of memory */
+static tSuperblock *	takeEmptySuperblock(unsigned int node, unsigned int spanOrder);
+
+/* hand a superblock an arena is done with to the global heap's empty pool */
+static void			releaseArenaSuperblock(tSuperblock *pSuperblock);
+
+/* the work of mtmm_reserve - ready superblocks of a size class for count objects. Returns 0 if out of memory */
+static int			reserveSuperblocks(unsigned int sizeClass, size_t count);
+
+/* fault in the pages of fresh memory before it is first used */
+static void			prefaultMemory(void *p, size_t size);
+
+/* count memory mapped or faulted back in against the budget. With mayFail, returns 0 instead if it would go over the hard limit */
+static int			chargeFootprint(size_t size, int mayFail);
+
+/* count memory unmapped or purged */
+static void			creditFootprint(size_t size);
+
+/* over the soft limit - call the pressure callback, tighten the heaps and purge what they can spare. No lock may be held */
+static void			relievePressure(void);
+
+/* an allocation failed - returns 1 if it was the hard limit, after the pressure callback and a trim made room to try once more */
+static int			retryOverBudget(void);
+
+/* the work of malloc_trim. Returns the number of chunks and superblocks purged */
+static unsigned int	trimHeaps(void);
+
+/* give the memory of a region whose superblocks are all idle back to the OS. The caller holds the region mutex */
+static int			purgeRegion(tRegion *pRegion);
+
+/* mtmm_snapshot writes its records through a buffer on the stack, so it doesn't allocate while it looks at the heaps */
+#define SNAPSHOT_BUFFER_SIZE	8192
+
+typedef struct sSnapshotWriter
+{
+	int					fd;
+	int					isFailed;						/* a write failed - the rest of the snapshot is dropped */
+	unsigned int		used;
+	uint64_t			numRecords;
+	char				buffer[SNAPSHOT_BUFFER_SIZE];
+} tSnapshotWriter;
+
+/* add a record to the snapshot. type and size are filled in here */
+static void			writeSnapshotRecord(tSnapshotWriter *pWriter, void *pRecord, uint32_t type, uint32_t size);
+
+/* write out what is buffered */
+static void			flushSnapshot(tSnapshotWriter *pWriter);
+
+/* the snapshot record of one superblock, with its blocks counted if it holds a size class */
+static void			snapshotSuperblock(tSuperblock *pSuperblock, tMtmmSnapSuperblock *pRecord);
+
+/* MTMM_SNAPSHOT - write a snapshot to the file it names when the process exits */
+static void			writeExitSnapshot(void);
+
+/* the slow parts of mtmm_cache_alloc and mtmm_cache_free - trade the thread's magazine with the cache's depot */
+static void *		allocFromObjectCache(tMtmmCache *pCache);
+static void			freeToObjectCache(tMtmmCache *pCache, void *p);
+
+/* give the calling thread's magazines back to their caches. Runs when the thread exits */
+static void			flushThreadMagazines(void);
+
+/* sz bytes aligned to alignment, a power of two. Freed with free() */
+static void *		allocAligned(size_t alignment, size_t sz);
+
+/* malloc for the allocator itself - returns the header of the block, NULL on failure */
+static tBlockHeader *	mallocBlockHeader(size_t sz);
+
+/* special self initialising malloc - sets up the heaps on the first call, then allocates */
 static void * mallocInit(size_t sz);
 
+/* set up the heaps. Returns 0 on failure. The caller holds s_initMutex */
+static int		initHoard(void);
+
 /* the real malloc that does the allocation  */
 static void * mallocReal(size_t sz);
 
+/* the part of malloc that allocates from the superblocks, once the size class is known */
+static void *	allocFromSizeClass(unsigned int sizeClass);
+
 /* virtual function that points to either mallocInit or mallocReal */
 static void * (*mallocFunc)(size_t) = mallocInit;
+static pthread_mutex_t	s_initMutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void lockHeap(unsigned int heapNum);
 static void unlockHeap(unsigned int heapNum);
@@ -202,22 +771,26 @@ malloc (sz)
 */
 void * malloc (size_t sz)
 {	
-	return ((*mallocFunc)(sz));
+	return ((*__atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE))(sz));
 }
 void * mallocReal (size_t sz)
 {	
 	void			*p = 0;
-	unsigned int 	heapNum = GLOBAL_HEAP;
 	unsigned int	sizeClassIndex = 0U;
 		
 	DBG_MSG("malloc requested size: %d\n", sz);
 
 	if(sz < 1)
 	{
-		/* we don't do malloc under 1 byte! */
-		return 0;
+		/* a unique pointer, like glibc's - plenty of programs take NULL for out of memory */
+		sz = 1;
+	}
+	if (sz >= s_config.hoardThreshold && sz < s_config.mmapThreshold)
+	{
+		/* medium blocks come from the buddy chunks of our heap */
+		return allocMediumBlock(sz);
 	}
-	if (sz >= HOARD_THRESHOLD_MEM_SIZE)
+	if (sz >= s_config.hoardThreshold)
 	{
 		/* 'big' chunks we get from the OS */
 		p = allocateLargeMemoryChunk(sz);
@@ -228,40 +801,148 @@ void * mallocReal (size_t sz)
 		return p;
 	}
 	
-	/* hash to the correct heap */
-	if (!getHeapNumber(&heapNum))
+	if (!getSizeClass (sz, &sizeClassIndex))
 	{
 		return 0;
 	}
+	p = allocFromSizeClass(sizeClassIndex);
+	if (p)
+	{
+		((tBlockHeader *)(p - sizeof(tBlockHeader)))->requestedSize = (unsigned int)sz;
+	}
+	return p;
+}
+
+/* malloc for a size class known at compile time, see mtmm.h. Only the heaps have to be set up, and the threshold checked - it may
+have been lowered at run time below what the compiler sent here */
+void * mtmm_malloc_class(unsigned int sizeClass, size_t sz)
+{
+	void			*p;
+
+	if (sizeClass >= RECYCLED_CLASS || mallocInit == __atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE) ||
+		sz >= s_config.hoardThreshold)
+	{
+		return malloc(sz);
+	}
+	p = allocFromSizeClass(sizeClass);
+	if (p)
+	{
+		((tBlockHeader *)(p - sizeof(tBlockHeader)))->requestedSize = (unsigned int)sz;
+	}
+	return p;
+}
+
+static void *	allocFromSizeClass(unsigned int sizeClassIndex)
+{
+	void			*p = 0;
+	unsigned int 	heapNum = GLOBAL_HEAP;
+
+	DBG_MSG("sizeClassIndex =  %d\n", sizeClassIndex);
 	
-	DBG_MSG("heap =  %d\n", heapNum);
+	/* fast path - no heap locking at all */
+	p = allocFromCpuCache(sizeClassIndex);
+	if (p)
+	{
+		return p;
+	}
 	
-	if (!getSizeClass (sz, &sizeClassIndex))
+	/* hash to the correct heap */
+	if (!getHeapNumber(&heapNum))
 	{
 		return 0;
 	}
-	DBG_MSG("sizeClassIndex =  %d\n", sizeClassIndex);
 	
+	DBG_MSG("heap =  %d\n", heapNum);
+	
+	/* only a refusal during this attempt counts - an earlier one may have been followed by a success some other way */
+	t_overBudget = 0;
+	lockHeap(heapNum);
 	p = allocMem(heapNum, sizeClassIndex);
+	unlockHeap(heapNum);
 	DBG_MSG("after allocMem p=0x%x\n", (unsigned int)p);
 	if (!p)
 	{
-		return 0;
+		if (!retryOverBudget())
+		{
+			return 0;
+		}
+		p = allocFromSizeClass(sizeClassIndex);
+		t_budgetRetry = 0;
+		return p;
+	}
+	if (__atomic_load_n(&s_hoard.underPressure, __ATOMIC_RELAXED) && !s_config.maintenanceMs)
+	{
+		relievePressure();
 	}
 	
 	/* we found free memory! */
-	DBG_MSG("malloc'd %d bytes at p=0x%x in heap %d\n", sz,(unsigned int)p, heapNum);
+	DBG_MSG("malloc'd class %d at p=0x%x in heap %d\n", sizeClassIndex,(unsigned int)p, heapNum);
 	DBG_DUMP("end malloc");
 	return p;
 }
 
 static void * mallocInit(size_t sz) {
 
+	/* threads may race here, and under LD_PRELOAD libc may call in before main. The first one sets up the heaps, the others wait.
+	Allocations made while setting up - by pthread_create - already go to mallocReal */
+	pthread_mutex_lock(&s_initMutex);
+	if (mallocInit == __atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE) && !initHoard())
+	{
+		pthread_mutex_unlock(&s_initMutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&s_initMutex);
+	return mallocReal(sz);
+}
+
+static int		initHoard(void)
+{
 	int				heap, class;
 	tHeap			*pHeap;
 	tSizeClass		*pClass;
-	
-	for (heap = 0; heap < NUM_HEAPS; heap++)
+	char			*pEnv;
+
+	if (pthread_mutex_init(&s_hoard.regionMutex, NULL))
+	{
+		return 0;
+	}
+	if (pthread_key_create(&s_hoard.threadKey, releaseThreadHeap))
+	{
+		return 0;
+	}
+	loadConfig();
+	loadTopology();
+	for (class = 0; class < RECYCLED_CLASS; class++)
+	{
+		s_hoard.spanOrders[class] = getSpanOrder(class);
+	}
+	s_hoard.useHugepages = USE_HUGEPAGES;
+	pEnv = getenv("MTMM_HUGEPAGES");
+	if (pEnv)
+	{
+		s_hoard.useHugepages = atoi(pEnv);
+	}
+	s_hoard.pageSize = sysconf(_SC_PAGESIZE);
+#ifdef HAVE_RSEQ
+	/* registration failed or was disabled with glibc.pthread.rseq=0 - fall back to the heaps */
+	s_hoard.useCpuCaches = (__rseq_size > 0);
+#endif
+#ifdef HAVE_RSEQ_SECTIONS
+	/* fencing a cpu needs the process registered for it. Without that, every push and pop takes the busy flag */
+	s_hoard.useRseqSections = s_hoard.useCpuCaches && !syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+#endif
+
+	/* bounds below the configured values would mean no tuning */
+	if (s_config.fullnessFMax < s_config.fullnessF)
+	{
+		s_config.fullnessFMax = s_config.fullnessF;
+	}
+	if (s_config.emptyThresholdKMax < s_config.emptyThresholdK)
+	{
+		s_config.emptyThresholdKMax = s_config.emptyThresholdK;
+	}
+
+	for (heap = 0; heap < s_config.numHeaps; heap++)
 	{
 		pHeap = &s_hoard.heapArray[heap];
 		if (pthread_mutex_init(&pHeap->mutex, NULL))
@@ -269,6 +950,8 @@ static void * mallocInit(size_t sz) {
 			/* mutex init failed */
 			return 0;
 		}
+		pHeap->fullnessF = s_config.fullnessF;
+		pHeap->emptyThresholdK = s_config.emptyThresholdK;
 		for (class = 0; class < NUM_SIZE_CLASSES; class++)
 		{
 			pClass = &pHeap->sizeClasses[class];
@@ -281,9 +964,33 @@ static void * mallocInit(size_t sz) {
 		}	
 	}
 		
-    /* Now set the virtual malloc function to point to the real malloc. And run it */
-	mallocFunc = mallocReal;
-	return ((*mallocFunc)(sz));
+    /* Now set the virtual malloc function to point to the real malloc */
+	__atomic_store_n(&mallocFunc, mallocReal, __ATOMIC_RELEASE);
+
+	/* before the maintenance thread, so it doesn't purge the reserve while it is being laid out */
+	loadReserveProfile();
+
+	if (getenv("MTMM_SNAPSHOT"))
+	{
+		atexit(writeExitSnapshot);
+	}
+
+	/* only now - creating a thread allocates memory */
+	if (s_config.maintenanceMs)
+	{
+		pthread_t		thread;
+		pthread_attr_t	attr;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, maintenanceThread, NULL))
+		{
+			/* no thread - do the housekeeping inline after all */
+			s_config.maintenanceMs = 0;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	return 1;
 }
 
 
@@ -291,365 +998,2755 @@ void * calloc (size_t num, size_t sz)
 {	
 	void			*p = 0;
 	DBG_MSG("calloc requested size: %d\n", sz);
+	if (sz && num > ((size_t)-1) / sz)
+	{
+		/* num*sz would overflow */
+		return 0;
+	}
 	p = malloc(num*sz);
 	if (!p)
 	{
 		return 0;
 	}
-	memset(p, 0, sz);
+	memset(p, 0, num*sz);
 	DBG_MSG("calloc'd %d bytes at p=0x%x\n", sz*num,(unsigned int)p);
 	DBG_DUMP("end calloc");
 	return p;
 }
 
 /*
-The free() function frees the memory space pointed to by ptr, which must have been returned 
-by a previous call to malloc(), calloc() or realloc(). Otherwise, or if free(ptr) has already 
-been called before, undefined behavior occurs. If ptr is NULL, no operation is performed.
-
-free (ptr)
-1. If the block is “large”,
-2. Free the superblock to the operating system and return.
-3. Find the superblock s this block comes from and lock it.
-4. Lock heap i, the superblock’s owner.
-5. Deallocate the block from the superblock.
-6. u i ← u i − block size.
-7. s.u ← s.u − block size.
-8. If i = 0, unlock heap i and the superblock and return.
-9. If u i < a i − K ∗ S and u i < (1 − f) ∗ a i,
-10. Transfer a mostly-empty superblock s1
-to heap 0 (the global heap).
-11. u 0 ← u 0 + s1.u, u i ← u i − s1.u
-12. a 0 ← a 0 + S, a i ← a i − S
-13. Unlock heap i and the superblock.
+posix_memalign, aligned_alloc, memalign, valloc and pvalloc all end up in allocAligned
 */
-void free (void * ptr) 
-{  
-	tBlockHeader	*pBlockHeader;
-	tSuperblock		*pMySuperblock;
-	size_t			size;
-	unsigned int	heapNum;
-	
-	if (!ptr)
+int posix_memalign(void **memptr, size_t alignment, size_t sz)
+{
+	void			*p;
+
+	if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void *))
 	{
-		return;
+		return EINVAL;
 	}
-	
-	pBlockHeader = (tBlockHeader *)(ptr - sizeof(tBlockHeader));
-	
-	size = pBlockHeader->size;	 
-	if (size >= HOARD_THRESHOLD_MEM_SIZE)
+	p = allocAligned(alignment, sz);
+	if (!p && sz)
 	{
-		deallocateLargeMemoryChunk(ptr, size + sizeof(tBlockHeader));
-		return;
+		return ENOMEM;
 	}
-	
-	/* find where this block came from */
-	pMySuperblock = pBlockHeader->pMySuperblock;
-	heapNum = pMySuperblock->ownerHeap;
-	
-	lockHeap(heapNum);
-	lockClass(heapNum, pMySuperblock->sizeClass);
-	
-	if (!pBlockHeader->inUse)
+	*memptr = p;
+	return 0;
+}
+
+void * aligned_alloc(size_t alignment, size_t sz)
+{
+	if (!alignment || (alignment & (alignment - 1)))
 	{
-		unlockHeap(heapNum);
-		unlockClass(heapNum, pMySuperblock->sizeClass);
-		return;
+		errno = EINVAL;
+		return 0;
 	}
-	
-		
-	pBlockHeader->inUse = 0;
-	/* attach this block to the head of the free list */	
-	pBlockHeader->pNextFree = pMySuperblock->pFreeBlocksHead;
-	pMySuperblock->pFreeBlocksHead = pBlockHeader;
-	pMySuperblock->numFreeBlocks++;
-	
-	/* keep superblocks ordered by fullness */
-	reorderSuperblockInClass(heapNum, pMySuperblock->sizeClass, pMySuperblock);
-	
-	if (pMySuperblock->numFreeBlocks == pMySuperblock->numBlocks)
+	return allocAligned(alignment, sz);
+}
+
+void * memalign(size_t alignment, size_t sz)
+{
+	return aligned_alloc(alignment, sz);
+}
+
+void * valloc(size_t sz)
+{
+	return allocAligned(sysconf(_SC_PAGESIZE), sz);
+}
+
+void * pvalloc(size_t sz)
+{
+	size_t			pageSize = sysconf(_SC_PAGESIZE);
+
+	if (sz > (size_t)-1 - pageSize)
 	{
-		/* An empty superblock container, recycle it! */
-		recycleSuperblock(heapNum, RECYCLED_CLASS, pMySuperblock);
+		return 0;
 	}
-	
-	updateMemoryUsed(heapNum, (-1)*pMySuperblock->blockSize);
-	/* Check heap invariants, if necessary move superblock to global heap */		
-	checkInvariantAndMoveSuperblocks(heapNum);	
-	
-	unlockHeap(heapNum);
-	unlockClass(heapNum, pMySuperblock->sizeClass);
-	
-	DBG_MSG("freed'd %d bytes at p=0x%x in heap %d\n", size,(unsigned int)ptr, heapNum);
-	DBG_DUMP("end free");
+	return allocAligned(pageSize, (sz + pageSize - 1) & ~(pageSize - 1));
 }
 
-/*
-
-The realloc() function changes the size of the memory block pointed to by ptr to size bytes. 
-The contents will be unchanged in the range from the start of the region up to the minimum 
-of the old and new sizes. If the new size is larger than the old size, the added memory 
-will not be initialized. If ptr is NULL, then the call is equivalent to malloc(size), 
-for all values of size; if size is equal to zero, and ptr is not NULL, then the call 
-is equivalent to free(ptr). Unless ptr is NULL, it must have been returned by an earlier 
-call to malloc(), calloc() or realloc(). If the area pointed to was moved, a free(ptr) is done. 
+/* The header is reached from the allocator's own pointer. Reading it from behind what the public malloc returned is, as far as
+the compiler knows, outside the object malloc allocated */
+static tBlockHeader *	mallocBlockHeader(size_t sz)
+{
+	void			*p = (*__atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE))(sz);
 
+	return p ? (tBlockHeader *)(p - sizeof(tBlockHeader)) : 0;
+}
 
-1. allocate sz bytes
-2. copy from old location to a new one
-3. free old allocation
-*/
-void * realloc (void * ptr, size_t sz) 
+/* Up to BLOCK_ALIGNMENT an object of at least the alignment is aligned already. Beyond that the object is taken out of a block
+alignment - BLOCK_ALIGNMENT bigger: the block starts BLOCK_ALIGNMENT aligned, so an unaligned start is at least BLOCK_ALIGNMENT before
+the next aligned address, and there is room for a BLOCK_ALIGNED header in between that leads free() back to the block */
+static void *		allocAligned(size_t alignment, size_t sz)
 {
-	void			*p = 0;
-	size_t			originalSize;
-	size_t			sizeToCopy;
-	
-	DBG_MSG("realloc ptr 0x%x requested size: %d\n", (unsigned int)ptr, sz);
+	tBlockHeader	*pBlockHeader, *pAlignedHeader;
+	void			*p, *pAligned;
 
-	/*If ptr is NULL, then the call is equivalent to malloc(size)*/
-	if (!ptr)
+	if (alignment <= BLOCK_ALIGNMENT)
 	{
-		return malloc(sz);
+		return malloc(sz > alignment ? sz : alignment);
 	}
-	
-	/*if size is equal to zero, and ptr is not NULL, then the call is equivalent to free(ptr) */
-	if(!sz)
+	if (!sz || sz > (size_t)-1 - alignment)
 	{
-		free(ptr);
-		return ptr;
+		return 0;
 	}
-
-	originalSize = ((tBlockHeader *)(ptr - sizeof(tBlockHeader)))->size;	
-	sizeToCopy = sz > originalSize? originalSize:sz;
-	
-	p = malloc(sz);
-	if (!p)
+	pBlockHeader = mallocBlockHeader(sz + alignment - BLOCK_ALIGNMENT);
+	if (!pBlockHeader)
 	{
 		return 0;
 	}
-	
-	if ( p != memcpy(p,ptr,sizeToCopy))
+	p = (void *)pBlockHeader + sizeof(tBlockHeader);
+	if (!((uintptr_t)p & (alignment - 1)))
 	{
-		/* something went wrong during the copy.. */
-		return 0;
+		return p;
 	}
-	/* just free the original pointer and return the new one */
-	free(ptr);
-	
-	DBG_MSG("realloc'd %d bytes at p=0x%x\n", sz,(unsigned int)ptr);
-	DBG_DUMP("end realloc");
-	return p;	
+	pAligned = (void *)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	pAlignedHeader = (tBlockHeader *)(pAligned - sizeof(tBlockHeader));
+	pAlignedHeader->inUse = BLOCK_ALIGNED;
+	pAlignedHeader->size = pBlockHeader->size - (pAligned - p);
+	pAlignedHeader->pAlignedFrom = pBlockHeader;
+	pAlignedHeader->pMySuperblock = pBlockHeader->pMySuperblock;
+	return pAligned;
 }
 
-static void *	allocateLargeMemoryChunk(size_t	sz)
+/*
+Set a tuning parameter, see mtmm.h. The environment is read first so that a call here wins over MTMM_CONF
+*/
+int mtmm_mallopt(int param, double value)
 {
-	int fd;
-	void *p;
-
-	DBG_ENTRY	
-	fd = open("/dev/zero", O_RDWR);
-	
-	if (fd == -1){
+	if (mallocFunc != mallocInit)
+	{
+		/* too late - heaps and superblocks are already laid out */
 		return 0;
 	}
-	
-	p = mmap(0, sz + sizeof(tBlockHeader), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-	close(fd);
+	loadConfig();
+	return setConfig(param, value);
+}
 
-	if (p == MAP_FAILED){
+/*
+Statistics of one heap, see mtmm.h. Read without locking, so the numbers are only roughly consistent with each other
+*/
+int mtmm_heap_stats(unsigned int heap, tMtmmHeapStats *pStats)
+{
+	tHeap		*pHeap;
+	
+	if (!pStats || heap >= s_config.numHeaps)
+	{
 		return 0;
 	}
+	pHeap = &s_hoard.heapArray[heap];
+	pStats->memoryInUse = __atomic_load_n(&pHeap->statMemoryInUse, __ATOMIC_RELAXED);
+	pStats->memoryHeld = __atomic_load_n(&pHeap->statMemoryHeld, __ATOMIC_RELAXED);
+	pStats->transfersToGlobal = __atomic_load_n(&pHeap->numToGlobal, __ATOMIC_RELAXED);
+	pStats->transfersFromGlobal = __atomic_load_n(&pHeap->numFromGlobal, __ATOMIC_RELAXED);
+	/* before the first allocation the heaps have no values of their own yet */
+	pStats->emptyThresholdK = mallocFunc == mallocInit ? s_config.emptyThresholdK : pHeap->emptyThresholdK;
+	pStats->fullnessF = mallocFunc == mallocInit ? s_config.fullnessF : pHeap->fullnessF;
+	return 1;
+}
 
-	((tBlockHeader *) p) -> size = sz;
+/*
+Ready superblocks for count objects of size sz ahead of time, see mtmm.h
+*/
+int mtmm_reserve(size_t sz, size_t count)
+{
+	unsigned int	sizeClass;
 
-	DBG_EXIT
-	return (p + sizeof(tBlockHeader));	
+	if (mallocInit == __atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE))
+	{
+		/* set up the heaps - and run the MTMM_RESERVE profile first */
+		free(malloc(1));
+	}
+	if (sz >= s_config.hoardThreshold)
+	{
+		return 0;
+	}
+	getSizeClass(sz ? sz : 1, &sizeClass);
+	return reserveSuperblocks(sizeClass, count);
 }
 
-static void deallocateLargeMemoryChunk(void * ptr, size_t sz)
+/*
+Set the memory budget, see mtmm.h. Takes effect from the next time memory is mapped
+*/
+int mtmm_set_budget(size_t softLimit, size_t hardLimit, void (*pCallback)(int level, size_t footprint))
 {
-	DBG_ENTRY
-	
-	if (munmap(ptr - sizeof(tBlockHeader), sz) < 0)
+	if (softLimit && hardLimit && softLimit > hardLimit)
 	{
-		perror(NULL);
+		return 0;
 	}
-
-	DBG_EXIT
+	__atomic_store_n(&s_config.softLimit, softLimit, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_config.hardLimit, hardLimit, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_hoard.pPressureCallback, pCallback, __ATOMIC_RELEASE);
+	__atomic_store_n(&s_hoard.pressureMark, 0, __ATOMIC_RELAXED);
+	if (softLimit && __atomic_load_n(&s_hoard.footprint, __ATOMIC_RELAXED) > softLimit)
+	{
+		/* already over - the next slow malloc or maintenance tick relieves it */
+		__atomic_store_n(&s_hoard.underPressure, 1, __ATOMIC_RELAXED);
+	}
+	return 1;
 }
 
-static int		getHeapNumber(unsigned int *pHeapNumber)
+/*
+Memory mapped from the OS and not purged, see mtmm.h
+*/
+size_t mtmm_footprint(void)
 {
-	pthread_t         self;
-	self = pthread_self();
-	
-	DBG_MSG("self =  0x%.8x\n", (unsigned int)self);
-	
-	/* trying to reduce the probability that two threads will use the same heap */
-	*pHeapNumber = ((self >> 12) % (NUM_HEAPS-1)) + 1;
-	return 1;	
+	return __atomic_load_n(&s_hoard.footprint, __ATOMIC_RELAXED);
 }
 
-/* Get size class by rounding up requested size to next highest power of 2, return that power. */
-static int		getSizeClass    (size_t	requestedSize, unsigned int *pNextPowerOfTwo)
+/*
+Write a snapshot of the heaps to fd, see mtmm.h and mtmm_snapshot.h. The heaps are read without stopping them - every heap and
+every superblock is consistent in itself, but other threads may go on allocating while the snapshot is taken
+*/
+int mtmm_snapshot(int fd)
 {
-	int		count = 0;
-	int		dividedByTwo = requestedSize -1; /*subtracting 1 so that if the requested size is exact power, we won't round up */
-	
-	while (dividedByTwo)
+	tSnapshotWriter			writer;
+	tMtmmSnapHeader			header;
+	tMtmmSnapHeap			heapRecord;
+	tMtmmSnapSizeClass		classRecord;
+	tMtmmSnapSuperblock		superblockRecord;
+	tMtmmSnapMediumChunk	chunkRecord;
+	tMtmmSnapEnd			end;
+	tHeap					*pHeap;
+	tRegion					*pRegion;
+	tMediumChunk			*pChunk;
+	unsigned int			heap, sizeClass, region, numRegions, superblock, numCarved;
+	int						level;
+
+	if (mallocInit == __atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE))
 	{
-		dividedByTwo = dividedByTwo/2;
-		count++;
+		return 0;
 	}
+	writer.fd = fd;
+	writer.isFailed = 0;
+	writer.used = 0;
+	writer.numRecords = 0;
 
-	*pNextPowerOfTwo = count;
-	return 1;
-}
+	memset(&header, 0, sizeof(header));
+	header.magic = MTMM_SNAPSHOT_MAGIC;
+	header.version = MTMM_SNAPSHOT_VERSION;
+	header.numHeaps = s_config.numHeaps;
+	header.numSizeClasses = RECYCLED_CLASS;
+	header.blockHeaderSize = sizeof(tBlockHeader);
+	header.regionSize = REGION_SIZE;
+	header.hoardThreshold = s_config.hoardThreshold;
+	header.mmapThreshold = s_config.mmapThreshold;
+	header.mediumChunkSize = MEDIUM_CHUNK_SIZE;
+	header.mediumUnitSize = 1UL << MEDIUM_MIN_ORDER;
+	header.footprint = __atomic_load_n(&s_hoard.footprint, __ATOMIC_RELAXED);
+	header.numLargeChunks = __atomic_load_n(&s_hoard.numLargeChunks, __ATOMIC_RELAXED);
+	header.largeChunkBytes = __atomic_load_n(&s_hoard.largeChunkBytes, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&s_hoard.regionMutex);
+	numRegions = s_hoard.numRegions;
+	for (pChunk = s_hoard.pFreeMediumChunks; pChunk; pChunk = pChunk->pNext)
+	{
+		header.numFreeMediumChunks++;
+	}
+	pthread_mutex_unlock(&s_hoard.regionMutex);
+	header.numRegions = numRegions;
+	header.numNodes = s_hoard.numNodes;
+	writeSnapshotRecord(&writer, &header, MTMM_SNAP_HEADER, sizeof(header));
 
-static tSuperblock	*	createSuperblock(unsigned int heapNum, unsigned int sizeClass)
-{
-	int 		fd;
-	tSuperblock *pNewSuperblock	= 0;
-	void		*p				= 0;
-  
-	DBG_ENTRY	
-		
-	fd = open("/dev/zero", O_RDWR);
-	
-	if (fd == -1){
-		return 0;
+	for (heap = 0; heap < s_config.numHeaps; heap++)
+	{
+		pHeap = &s_hoard.heapArray[heap];
+		memset(&heapRecord, 0, sizeof(heapRecord));
+		heapRecord.heap = heap;
+		heapRecord.numThreads = __atomic_load_n(&pHeap->numThreads, __ATOMIC_RELAXED);
+		heapRecord.memoryInUse = __atomic_load_n(&pHeap->statMemoryInUse, __ATOMIC_RELAXED);
+		heapRecord.memoryHeld = __atomic_load_n(&pHeap->statMemoryHeld, __ATOMIC_RELAXED);
+		heapRecord.emptyThresholdK = pHeap->emptyThresholdK;
+		heapRecord.numEmptyMediumChunks = pHeap->numEmptyMediumChunks;
+		heapRecord.fullnessF = pHeap->fullnessF;
+		heapRecord.node = s_hoard.heapNodes[heap];
+		writeSnapshotRecord(&writer, &heapRecord, MTMM_SNAP_HEAP, sizeof(heapRecord));
 	}
-	
-	pNewSuperblock = mmap(0, sizeof(tSuperblock), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);	
-	
-	if (pNewSuperblock == MAP_FAILED){
-		close(fd);
-		return 0;
+
+	for (sizeClass = 0; sizeClass < RECYCLED_CLASS; sizeClass++)
+	{
+		memset(&classRecord, 0, sizeof(classRecord));
+		classRecord.sizeClass = sizeClass;
+		classRecord.numBlocksOut = __atomic_load_n(&s_hoard.classCounts[sizeClass].numBlocksOut, __ATOMIC_RELAXED);
+		classRecord.peakBlocksOut = __atomic_load_n(&s_hoard.classCounts[sizeClass].peakBlocksOut, __ATOMIC_RELAXED);
+		if (classRecord.peakBlocksOut)
+		{
+			writeSnapshotRecord(&writer, &classRecord, MTMM_SNAP_SIZE_CLASS, sizeof(classRecord));
+		}
 	}
-	
-	p = mmap(0, SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);	
-	close(fd);
 
-	if (p == MAP_FAILED){
-		return 0;
+	/* every superblock ever carved, wherever it is now - in a heap, on a global heap stack, in an arena or idle */
+	for (region = 0; region < numRegions; region++)
+	{
+		pRegion = s_hoard.pRegionTable[region];
+		numCarved = __atomic_load_n(&pRegion->numCarved, __ATOMIC_ACQUIRE);
+		for (superblock = 0; superblock < numCarved; superblock++)
+		{
+			snapshotSuperblock(&pRegion->superblocks[superblock], &superblockRecord);
+			writeSnapshotRecord(&writer, &superblockRecord, MTMM_SNAP_SUPERBLOCK, sizeof(superblockRecord));
+		}
 	}
-	DBG_MSG("p 0x%X\n", (unsigned int)p);
-	
-	/* Initialize the superblock structure */
-	pNewSuperblock->pBlockArray = (tBlockHeader *)p;	
-	
-	initSuperblock(heapNum, sizeClass, pNewSuperblock);
-	
-	DBG_EXIT
-	return pNewSuperblock;	
+
+	for (heap = 1; heap < s_config.numHeaps; heap++)
+	{
+		lockHeap(heap);
+		for (pChunk = s_hoard.heapArray[heap].pMediumChunks; pChunk; pChunk = pChunk->pNext)
+		{
+			memset(&chunkRecord, 0, sizeof(chunkRecord));
+			chunkRecord.ownerHeap = heap;
+			chunkRecord.numFreeUnits = pChunk->numFreeUnits;
+			for (level = NUM_MEDIUM_ORDERS - 1; level >= 0 && !pChunk->freeMap[level]; level--);
+			chunkRecord.largestFreeUnits = level < 0 ? 0 : 1U << level;
+			/* the buffer may fill up - a write with the heap locked only holds up that heap */
+			writeSnapshotRecord(&writer, &chunkRecord, MTMM_SNAP_MEDIUM_CHUNK, sizeof(chunkRecord));
+		}
+		unlockHeap(heap);
+	}
+
+	memset(&end, 0, sizeof(end));
+	end.numRecords = writer.numRecords;
+	writeSnapshotRecord(&writer, &end, MTMM_SNAP_END, sizeof(end));
+	flushSnapshot(&writer);
+	return !writer.isFailed;
 }
 
-/* Initialize the superblock for a given size class and heap */
-static void initSuperblock(unsigned int heapNum, unsigned int sizeClass, tSuperblock *pSuperblock)
+static void			writeSnapshotRecord(tSnapshotWriter *pWriter, void *pRecord, uint32_t type, uint32_t size)
 {
-
-	void			*pNewBlock;				/* first block in superblock */
-	void			*pEndOfSuperblock;		/* end of last block in superblock */
-	size_t			blockSize, blockSizeWithHeader;	/* user memory chunk + header */
-	unsigned int	numBlocks = 0;			/* final count depends on block size */
-	
-	DBG_ENTRY
-	pNewBlock			= (void*) (pSuperblock -> pBlockArray);
-	/* The actual block size is a power of two */
-	blockSize = 1 << sizeClass;
-	pEndOfSuperblock	= pNewBlock + SUPERBLOCK_SIZE;
-	blockSizeWithHeader = blockSize + sizeof(tBlockHeader);
-	
-	DBG_MSG("1st block 0x%X end 0x%X blockSize %d blockSizeWithHeader %d\n",
-			(unsigned int)pNewBlock, (unsigned int)pEndOfSuperblock, blockSize, blockSizeWithHeader);
-			
-	/* fit in as many blocks as possible into the superblock */
-	while (pNewBlock + blockSizeWithHeader < pEndOfSuperblock)
-	{		
-		/* init each block */				
-		((tBlockHeader *)pNewBlock) -> inUse = 0U; 
-		((tBlockHeader *)pNewBlock) -> size = blockSize;
-		((tBlockHeader *)pNewBlock) -> pMySuperblock = pSuperblock;
-		((tBlockHeader *)pNewBlock) -> pNextFree = pNewBlock + blockSizeWithHeader;
-		/* advance to next block */
-		pNewBlock += blockSizeWithHeader;
-		numBlocks++;
+	((tMtmmSnapRecord *)pRecord)->type = type;
+	((tMtmmSnapRecord *)pRecord)->size = size;
+	if (pWriter->used + size > SNAPSHOT_BUFFER_SIZE)
+	{
+		flushSnapshot(pWriter);
 	}
-	
-	/* set the last block as the tail */
-	((tBlockHeader *)pNewBlock) -> pNextFree = 0;
-	
-	DBG_MSG("numBlocks in superblock with class size %d:  %d\n",blockSize, numBlocks);
-	
-	/* init the superblock */
-	pSuperblock->pPrev = 0;
-	pSuperblock->pNext = 0;						
-	pSuperblock->sizeClass = sizeClass;
-	pSuperblock->blockSize = blockSize;
-	pSuperblock->ownerHeap = heapNum;
-	pSuperblock->numBlocks = numBlocks;
-	pSuperblock->numFreeBlocks = numBlocks;	
-	pSuperblock->pFreeBlocksHead = pSuperblock->pBlockArray;
-	
-	/* now update how much memory is held. Note that this is not the real amount of memory - but
-	rather the amount of memory held that will be taken in to account when calculating how 'empty' a superblock is */
-	updateMemoryHeld(heapNum, (pSuperblock->numBlocks * pSuperblock->blockSize));
-	
-	DBG_EXIT
+	memcpy(pWriter->buffer + pWriter->used, pRecord, size);
+	pWriter->used += size;
+	pWriter->numRecords++;
 }
 
+static void			flushSnapshot(tSnapshotWriter *pWriter)
+{
+	unsigned int	written = 0;
+	ssize_t			n;
 
-static void * allocMem(unsigned int heapNum, unsigned int sizeClass)
+	while (!pWriter->isFailed && written < pWriter->used)
+	{
+		n = write(pWriter->fd, pWriter->buffer + written, pWriter->used - written);
+		if (n < 0 && EINTR != errno)
+		{
+			pWriter->isFailed = 1;
+		}
+		else if (n > 0)
+		{
+			written += n;
+		}
+	}
+	pWriter->used = 0;
+}
+
+/* The descriptor is copied field by field without the superblock's lock, so the counts may be a little behind. The blocks are only
+walked for a superblock that holds a size class and is not idle - an idle one may be purged, and its headers are gone */
+static void			snapshotSuperblock(tSuperblock *pSuperblock, tMtmmSnapSuperblock *pRecord)
 {
-	void *p;
-	DBG_ENTRY
-	/* Is there a free block in this heap (in the appropriate size class) */
-	p = allocFromFreeBlockInHeap(heapNum, sizeClass);
-	if (p)
+	tBlockHeader	*pBlockHeader;
+	char			*pBlock;
+	size_t			blockSize, stride;
+	unsigned int	block, numBlocks, sizeClass;
+
+	memset(pRecord, 0, sizeof(*pRecord));
+	sizeClass = __atomic_load_n(&pSuperblock->sizeClass, __ATOMIC_RELAXED);
+	blockSize = __atomic_load_n(&pSuperblock->blockSize, __ATOMIC_RELAXED);
+	numBlocks = __atomic_load_n(&pSuperblock->numBlocks, __ATOMIC_RELAXED);
+	pRecord->index = pSuperblock->index;
+	pRecord->ownerHeap = __atomic_load_n(&pSuperblock->ownerHeap, __ATOMIC_RELAXED);
+	pRecord->sizeClass = sizeClass < RECYCLED_CLASS ? sizeClass : RECYCLED_CLASS;
+	pRecord->spanOrder = pSuperblock->spanOrder;
+	pRecord->node = pSuperblock->pRegion->node;
+	pRecord->numBlocks = numBlocks;
+	pRecord->numFreeBlocks = __atomic_load_n(&pSuperblock->numFreeBlocks, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&pSuperblock->isIdle, __ATOMIC_RELAXED))
 	{
-		DBG_EXIT
-		return p;
+		pRecord->state |= MTMM_SNAP_IDLE;
 	}
-	
-	/* So check to see if we can use a recycled superblock */
-	p = allocFromFreeBlockInHeap(heapNum, RECYCLED_CLASS);
-	if (p)
+	if (__atomic_load_n(&pSuperblock->isPurged, __ATOMIC_RELAXED))
 	{
-		DBG_EXIT
-		return p;
+		pRecord->state |= MTMM_SNAP_PURGED;
 	}
-	
-	/* So try the global heap */	
-	p = allocFromFreeBlockInHeap(GLOBAL_HEAP, sizeClass);
-	if (p)
+	if (LENT_CLASS == sizeClass)
 	{
-		/* move superblock to appropriate size class in regular heap */
-		
-		/* lock global heap */
-		lockHeap(GLOBAL_HEAP);
-		
-		moveSuperblockFromTo(GLOBAL_HEAP, heapNum, ((tBlockHeader *)(p - sizeof(tBlockHeader)))->pMySuperblock);
-		
-		unlockHeap(GLOBAL_HEAP);
-		
-		DBG_EXIT
-		return p;
+		pRecord->state |= MTMM_SNAP_LENT;
+		return;
 	}
-	/* No free chunk in global heap either. So try to allocate from a new superblock allocated from OS */ 
-	/* get a new superblock for this heap and add to appropriate size class */
-	p = allocFromFreeBlockInNewSuperblock(heapNum, sizeClass);
-		
-	/* whether we failed or succeeded, return pointer - will either be NULL or point to allocated block */
-	DBG_EXIT
-	return p;
-	
-}
-
+	stride = blockSize + sizeof(tBlockHeader);
+	if (sizeClass >= RECYCLED_CLASS || pRecord->state || blockSize != (size_t)1 << sizeClass ||
+		numBlocks * stride > (size_t)1 << pSuperblock->spanOrder)
+	{
+		/* no class, idle or caught in the middle of being recycled */
+		return;
+	}
+	pBlock = (char *)pSuperblock->pBlockArray;
+	for (block = 0; block < numBlocks; block++, pBlock += stride)
+	{
+		pBlockHeader = (tBlockHeader *)pBlock;
+		switch (__atomic_load_n(&pBlockHeader->inUse, __ATOMIC_RELAXED))
+		{
+			case BLOCK_IN_USE:
+				pRecord->requestedBytes += pBlockHeader->requestedSize < blockSize ? pBlockHeader->requestedSize : blockSize;
+				break;
+			case BLOCK_CACHED:
+				pRecord->numCachedBlocks++;
+				break;
+		}
+	}
+}
+
+/* registered with atexit by initHoard. Errors go nowhere - the process is on its way out */
+static void			writeExitSnapshot(void)
+{
+	char			*pPath = getenv("MTMM_SNAPSHOT");
+	int				fd;
+
+	if (!pPath || !*pPath)
+	{
+		return;
+	}
+	fd = open(pPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return;
+	}
+	mtmm_snapshot(fd);
+	close(fd);
+}
+
+/*
+A new empty arena, see mtmm.h. It takes no superblock until the first allocation
+*/
+tMtmmArena * mtmm_arena_create(void)
+{
+	tMtmmArena		*pArena;
+
+	/* this also sets up the heaps on the very first allocation */
+	pArena = malloc(sizeof(tMtmmArena));
+	if (!pArena)
+	{
+		return 0;
+	}
+	memset(pArena, 0, sizeof(tMtmmArena));
+	pArena->spanOrder = s_config.minSpanOrder > ARENA_SPAN_ORDER ? s_config.minSpanOrder : ARENA_SPAN_ORDER;
+	return pArena;
+}
+
+/*
+Bump allocate from the arena's current superblock, taking a new one when it runs out
+*/
+void * mtmm_arena_alloc(tMtmmArena *pArena, size_t sz)
+{
+	tSuperblock		*pSuperblock;
+	void			**ppLarge;
+	size_t			alignment;
+	char			*p;
+
+	if (!pArena || sz < 1)
+	{
+		return 0;
+	}
+	if (sz > ((size_t)1 << pArena->spanOrder) / 4)
+	{
+		/* too big for a superblock. The link to the next one sits in front of the object */
+		if (sz > (size_t)-1 - ARENA_ALIGNMENT)
+		{
+			return 0;
+		}
+		ppLarge = malloc(ARENA_ALIGNMENT + sz);
+		if (!ppLarge)
+		{
+			return 0;
+		}
+		*ppLarge = pArena->pLargeObjects;
+		pArena->pLargeObjects = ppLarge;
+		return (char *)ppLarge + ARENA_ALIGNMENT;
+	}
+
+	for (alignment = 1; alignment < sz && alignment < ARENA_ALIGNMENT; alignment <<= 1);
+	p = (char *)(((uintptr_t)pArena->pNextFree + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	if (!pArena->pNextFree || p + sz > pArena->pEnd)
+	{
+		pSuperblock = takeEmptySuperblock(getThreadNode(), pArena->spanOrder);
+		if (!pSuperblock)
+		{
+			return 0;
+		}
+		pSuperblock->pNext = pArena->pSuperblocks;
+		pArena->pSuperblocks = pSuperblock;
+		p = (char *)pSuperblock->pBlockArray;
+		pArena->pEnd = p + ((size_t)1 << pArena->spanOrder);
+	}
+	pArena->pNextFree = p + sz;
+	return p;
+}
+
+/*
+Give back everything but the superblock being carved, and start carving it from the beginning again
+*/
+void mtmm_arena_reset(tMtmmArena *pArena)
+{
+	tSuperblock		*pSuperblock, *pNext;
+	void			*pLarge;
+
+	if (!pArena)
+	{
+		return;
+	}
+	while (pArena->pLargeObjects)
+	{
+		pLarge = pArena->pLargeObjects;
+		pArena->pLargeObjects = *(void **)pLarge;
+		free(pLarge);
+	}
+	if (!pArena->pSuperblocks)
+	{
+		return;
+	}
+	for (pSuperblock = pArena->pSuperblocks->pNext; pSuperblock; pSuperblock = pNext)
+	{
+		pNext = pSuperblock->pNext;
+		releaseArenaSuperblock(pSuperblock);
+	}
+	pArena->pSuperblocks->pNext = NULL;
+	pArena->pNextFree = (char *)pArena->pSuperblocks->pBlockArray;
+}
+
+void mtmm_arena_destroy(tMtmmArena *pArena)
+{
+	if (!pArena)
+	{
+		return;
+	}
+	mtmm_arena_reset(pArena);
+	if (pArena->pSuperblocks)
+	{
+		releaseArenaSuperblock(pArena->pSuperblocks);
+	}
+	free(pArena);
+}
+
+/*
+A new object cache, see mtmm.h. The span is picked like a size class's, from the object size
+*/
+tMtmmCache * mtmm_cache_create(size_t objSize, size_t align, void (*ctor)(void *))
+{
+	tMtmmCache		*pCache;
+	unsigned int	index;
+
+	if (!objSize || objSize > OBJECT_CACHE_MAX_SIZE)
+	{
+		return 0;
+	}
+	if (!align)
+	{
+		/* the biggest power of two the size is a multiple of, up to 16 */
+		for (align = 1; align < ARENA_ALIGNMENT && !(objSize & align); align <<= 1);
+	}
+	if ((align & (align - 1)) || align > OBJECT_CACHE_MAX_SIZE)
+	{
+		return 0;
+	}
+
+	/* this also sets up the heaps on the very first allocation */
+	pCache = malloc(sizeof(tMtmmCache));
+	if (!pCache)
+	{
+		return 0;
+	}
+	index = __atomic_fetch_add(&s_hoard.numObjectCaches, 1, __ATOMIC_RELAXED);
+	if (index >= MAX_OBJECT_CACHES)
+	{
+		free(pCache);
+		return 0;
+	}
+	memset(pCache, 0, sizeof(tMtmmCache));
+	pthread_mutex_init(&pCache->mutex, NULL);
+	pCache->index = index;
+	pCache->ctor = ctor;
+	/* superblocks are aligned to their span, so objects of a multiple of the alignment stay aligned. Every object can hold a link
+	for pStrayObjects */
+	if (objSize < sizeof(void *))
+	{
+		objSize = sizeof(void *);
+	}
+	pCache->objSize = (objSize + align - 1) & ~(align - 1);
+	pCache->spanOrder = s_config.minSpanOrder > OBJECT_CACHE_SPAN_ORDER ? s_config.minSpanOrder : OBJECT_CACHE_SPAN_ORDER;
+	while (pCache->spanOrder < REGION_ORDER && ((size_t)1 << pCache->spanOrder) < s_config.minBlocksPerSuperblock * pCache->objSize)
+	{
+		pCache->spanOrder++;
+	}
+	__atomic_store_n(&s_hoard.pObjectCaches[index], pCache, __ATOMIC_RELEASE);
+	return pCache;
+}
+
+/*
+Pop an object off the thread's magazine - no locking at all
+*/
+void * mtmm_cache_alloc(tMtmmCache *pCache)
+{
+	tMagazine		*pMagazine = t_pMagazines[pCache->index];
+
+	if (pMagazine && pMagazine->numObjects)
+	{
+		return pMagazine->pObjects[--pMagazine->numObjects];
+	}
+	return allocFromObjectCache(pCache);
+}
+
+/*
+Push an object on the thread's magazine - no locking at all
+*/
+void mtmm_cache_free(tMtmmCache *pCache, void *p)
+{
+	tMagazine		*pMagazine = t_pMagazines[pCache->index];
+
+	if (!p)
+	{
+		return;
+	}
+	if (pMagazine && pMagazine->numObjects < MAGAZINE_SIZE)
+	{
+		pMagazine->pObjects[pMagazine->numObjects++] = p;
+		return;
+	}
+	freeToObjectCache(pCache, p);
+}
+
+/* Read the tuning parameters from MTMM_CONF, e.g. MTMM_CONF=heaps:32,f:0.25,k:4. Sizes may end with k or m.
+This runs inside the first malloc, so it parses by hand - strtod and friends may allocate */
+static void		loadConfig(void)
+{
+	const char		*pConf;
+	char			name[16];
+	unsigned int	len, i;
+	double			value;
+
+	if (s_config.isLoaded)
+	{
+		return;
+	}
+	s_config.isLoaded = 1;
+
+	pConf = getenv("MTMM_CONF");
+	while (pConf && *pConf)
+	{
+		for (len = 0; *pConf && *pConf != ':' && *pConf != ','; pConf++)
+		{
+			if (len < sizeof(name) - 1)
+			{
+				name[len++] = *pConf;
+			}
+		}
+		name[len] = 0;
+
+		if (':' == *pConf)
+		{
+			pConf++;
+			value = parseConfigValue(&pConf);
+
+			/* unknown names and bad values are ignored - the default stays */
+			for (i = 0; i < sizeof(s_configNames)/sizeof(s_configNames[0]); i++)
+			{
+				if (!strcmp(name, s_configNames[i].pName))
+				{
+					setConfig(s_configNames[i].param, value);
+				}
+			}
+		}
+
+		/* on to the next name */
+		while (*pConf && *pConf != ',')
+		{
+			pConf++;
+		}
+		if (',' == *pConf)
+		{
+			pConf++;
+		}
+	}
+}
+
+/* A decimal number, with a fraction and a k or m suffix allowed. 0 if there are no digits */
+static double	parseConfigValue(const char **ppConf)
+{
+	const char		*pConf = *ppConf;
+	double			value = 0, scale;
+
+	for (; *pConf >= '0' && *pConf <= '9'; pConf++)
+	{
+		value = value * 10 + (*pConf - '0');
+	}
+	if ('.' == *pConf)
+	{
+		for (pConf++, scale = 0.1; *pConf >= '0' && *pConf <= '9'; pConf++, scale /= 10)
+		{
+			value += (*pConf - '0') * scale;
+		}
+	}
+	if ('k' == *pConf || 'K' == *pConf)
+	{
+		value *= 1024;
+		pConf++;
+	}
+	else if ('m' == *pConf || 'M' == *pConf)
+	{
+		value *= 1024 * 1024;
+		pConf++;
+	}
+	else if ('g' == *pConf || 'G' == *pConf)
+	{
+		value *= 1024 * 1024 * 1024;
+		pConf++;
+	}
+	*ppConf = pConf;
+	return value;
+}
+
+/* MTMM_RESERVE is a list of size:count pairs like MTMM_CONF, or @ and the name of a file that holds them - separated by commas
+or white space, so a profile can be written one pair per line. The file is read with read() into a buffer on the stack:
+mallocs of stdio would find the heaps half set up */
+static void		loadReserveProfile(void)
+{
+	char			buffer[4096];
+	const char		*pProfile;
+	double			size, count;
+	ssize_t			len;
+	int				fd;
+
+	pProfile = getenv("MTMM_RESERVE");
+	if (!pProfile)
+	{
+		return;
+	}
+	if ('@' == *pProfile)
+	{
+		fd = open(pProfile + 1, O_RDONLY);
+		if (fd < 0)
+		{
+			return;
+		}
+		len = read(fd, buffer, sizeof(buffer) - 1);
+		close(fd);
+		if (len <= 0)
+		{
+			return;
+		}
+		buffer[len] = 0;
+		pProfile = buffer;
+	}
+	/* a profile saved with the name in front, as in the environment */
+	if (!strncmp(pProfile, "MTMM_RESERVE=", strlen("MTMM_RESERVE=")))
+	{
+		pProfile += strlen("MTMM_RESERVE=");
+	}
+
+	while (*pProfile)
+	{
+		size = parseConfigValue(&pProfile);
+		if (':' == *pProfile)
+		{
+			pProfile++;
+			count = parseConfigValue(&pProfile);
+			/* bad pairs are skipped, like bad MTMM_CONF values */
+			if (size < s_config.hoardThreshold && count >= 1)
+			{
+				unsigned int	sizeClass;
+
+				getSizeClass(size >= 1 ? (size_t)size : 1, &sizeClass);
+				reserveSuperblocks(sizeClass, (size_t)count);
+			}
+		}
+		/* on to the next pair */
+		while (*pProfile && ',' != *pProfile && ' ' != *pProfile && '\t' != *pProfile && '\n' != *pProfile)
+		{
+			pProfile++;
+		}
+		while (',' == *pProfile || ' ' == *pProfile || '\t' == *pProfile || '\n' == *pProfile || '\r' == *pProfile)
+		{
+			pProfile++;
+		}
+	}
+}
+
+/* Set one tuning parameter after checking it. Returns 1 on success, 0 if the parameter or the value is not valid */
+static int		setConfig(int param, double value)
+{
+	unsigned int	order;
+
+	switch (param)
+	{
+	case MTMM_OPT_HEAPS:
+		/* the global heap and at least one more */
+		if (value < 2 || value > MAX_HEAPS)
+		{
+			return 0;
+		}
+		s_config.numHeaps = (unsigned int)value;
+		return 1;
+	case MTMM_OPT_FULLNESS_F:
+		if (value <= 0 || value >= 1)
+		{
+			return 0;
+		}
+		s_config.fullnessF = value;
+		return 1;
+	case MTMM_OPT_EMPTY_K:
+		if (value < 0 || value > 1024)
+		{
+			return 0;
+		}
+		s_config.emptyThresholdK = (unsigned int)value;
+		return 1;
+	case MTMM_OPT_FULLNESS_F_MAX:
+		if (value <= 0 || value >= 1)
+		{
+			return 0;
+		}
+		s_config.fullnessFMax = value;
+		return 1;
+	case MTMM_OPT_EMPTY_K_MAX:
+		if (value < 0 || value > 1024)
+		{
+			return 0;
+		}
+		s_config.emptyThresholdKMax = (unsigned int)value;
+		return 1;
+	case MTMM_OPT_HOARD_THRESHOLD:
+		/* the size classes end at HOARD_THRESHOLD_MEM_SIZE - the threshold can only move down */
+		if (value < 1 || value > HOARD_THRESHOLD_MEM_SIZE)
+		{
+			return 0;
+		}
+		s_config.hoardThreshold = (size_t)value;
+		return 1;
+	case MTMM_OPT_MMAP_THRESHOLD:
+		/* the medium tier can't serve more than MEDIUM_MAX_SIZE. Set it to the hoard threshold to turn the medium tier off */
+		if (value < 1 || value > MMAP_THRESHOLD_MEM_SIZE)
+		{
+			return 0;
+		}
+		s_config.mmapThreshold = (size_t)value;
+		return 1;
+	case MTMM_OPT_SUPERBLOCK_MIN:
+		/* a power of two. Region descriptors have room for superblocks of MIN_SPAN_ORDER, so it can't be smaller than that */
+		for (order = MIN_SPAN_ORDER; order <= REGION_ORDER && ((size_t)1 << order) != value; order++)
+		{
+		}
+		if (order > REGION_ORDER)
+		{
+			return 0;
+		}
+		s_config.minSpanOrder = order;
+		return 1;
+	case MTMM_OPT_SUPERBLOCK_OBJECTS:
+		if (value < 1 || value > 1024)
+		{
+			return 0;
+		}
+		s_config.minBlocksPerSuperblock = (unsigned int)value;
+		return 1;
+	case MTMM_OPT_MAINTENANCE_MS:
+		if (value < 0 || value > 60000)
+		{
+			return 0;
+		}
+		s_config.maintenanceMs = (unsigned int)value;
+		return 1;
+	case MTMM_OPT_SOFT_LIMIT:
+		if (value < 0)
+		{
+			return 0;
+		}
+		s_config.softLimit = (size_t)value;
+		return 1;
+	case MTMM_OPT_HARD_LIMIT:
+		if (value < 0)
+		{
+			return 0;
+		}
+		s_config.hardLimit = (size_t)value;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+The free() function frees the memory space pointed to by ptr, which must have been returned 
+by a previous call to malloc(), calloc() or realloc(). Otherwise, or if free(ptr) has already 
+been called before, undefined behavior occurs. If ptr is NULL, no operation is performed.
+
+free (ptr)
+1. If the block is “large”,
+2. Free the superblock to the operating system and return.
+3. Find the superblock s this block comes from and lock it.
+4. Lock heap i, the superblock’s owner.
+5. Deallocate the block from the superblock.
+6. u i ← u i − block size.
+7. s.u ← s.u − block size.
+8. If i = 0, unlock heap i and the superblock and return.
+9. If u i < a i − K ∗ S and u i < (1 − f) ∗ a i,
+10. Transfer a mostly-empty superblock s1
+to heap 0 (the global heap).
+11. u 0 ← u 0 + s1.u, u i ← u i − s1.u
+12. a 0 ← a 0 + S, a i ← a i − S
+13. Unlock heap i and the superblock.
+*/
+void free (void * ptr) 
+{  
+	tBlockHeader	*pBlockHeader;
+	size_t			size;
+	
+	if (!ptr)
+	{
+		return;
+	}
+	
+	pBlockHeader = (tBlockHeader *)(ptr - sizeof(tBlockHeader));
+	if (BLOCK_ALIGNED == pBlockHeader->inUse)
+	{
+		/* free the block the aligned object was taken out of */
+		pBlockHeader = pBlockHeader->pAlignedFrom;
+		ptr = (void *)pBlockHeader + sizeof(tBlockHeader);
+	}
+	
+	size = pBlockHeader->size;	 
+	if (!pBlockHeader->pMySuperblock)
+	{
+		/* Only medium and large blocks have no superblock. Can't tell by the size - blocks of the largest size class are exactly HOARD_THRESHOLD_MEM_SIZE */
+		if (pBlockHeader->pMyChunk)
+		{
+			freeMediumBlock(pBlockHeader);
+			return;
+		}
+		deallocateLargeMemoryChunk(ptr, size + sizeof(tBlockHeader));
+		return;
+	}
+	
+	if (BLOCK_IN_USE != pBlockHeader->inUse)
+	{
+		/* freed twice */
+		return;
+	}
+	
+	/* fast path - park the block in the cpu cache */
+	/* a block in use keeps its superblock from being recycled, so the size class can't change under us */
+	if (freeToCpuCache(pBlockHeader, pBlockHeader->pMySuperblock->sizeClass))
+	{
+		return;
+	}
+	
+	freeBlock(pBlockHeader);
+	
+	DBG_MSG("freed'd %d bytes at p=0x%x\n", size,(unsigned int)ptr);
+	DBG_DUMP("end free");
+}
+
+/*
+free() for a caller that knows the size it asked for (C23). The size class comes from the size, so the fast path doesn't load the
+superblock descriptor free() takes it from. The block header is still read - it tells a superblock block in use from anything else -
+but it shares a cache line with the start of the block and is written right after anyway, to mark the block cached
+*/
+void free_sized(void *ptr, size_t sz)
+{
+	unsigned int	sizeClass;
+
+	if (sz >= s_config.hoardThreshold)
+	{
+		free(ptr);
+		return;
+	}
+	/* malloc(0) got a block of size 1 */
+	getSizeClass(sz ? sz : 1, &sizeClass);
+	mtmm_free_class(ptr, sizeClass);
+}
+
+/* free for a size class known at compile time, see mtmm.h. The header is checked - medium and large blocks have no superblock, and
+they, aligned objects and double frees take the long way through free() - but the superblock descriptor is only touched if the
+block goes past the cpu cache */
+void mtmm_free_class(void *ptr, unsigned int sizeClass)
+{
+	tBlockHeader	*pBlockHeader;
+
+	if (!ptr)
+	{
+		return;
+	}
+	pBlockHeader = (tBlockHeader *)(ptr - sizeof(tBlockHeader));
+	if (BLOCK_IN_USE != pBlockHeader->inUse || !pBlockHeader->pMySuperblock)
+	{
+		free(ptr);
+		return;
+	}
+	if (freeToCpuCache(pBlockHeader, sizeClass))
+	{
+		return;
+	}
+	freeBlock(pBlockHeader);
+}
+
+/* alignments up to BLOCK_ALIGNMENT came from a block of at least the alignment, see allocAligned */
+void free_aligned_sized(void *ptr, size_t alignment, size_t sz)
+{
+	if (alignment > BLOCK_ALIGNMENT)
+	{
+		free(ptr);
+		return;
+	}
+	free_sized(ptr, sz > alignment ? sz : alignment);
+}
+
+/* return a block to its superblock in the owning heap - the slow part of free */
+static void freeBlock(tBlockHeader *pBlockHeader)
+{
+	tSuperblock		*pMySuperblock;
+	unsigned int	heapNum;
+	
+	/* find where this block came from */
+	pMySuperblock = pBlockHeader->pMySuperblock;
+	
+	for (;;)
+	{
+		heapNum = __atomic_load_n(&pMySuperblock->ownerHeap, __ATOMIC_ACQUIRE);
+		if (GLOBAL_HEAP == heapNum)
+		{
+			if (freeBlockToGlobal(pBlockHeader))
+			{
+				return;
+			}
+			/* a heap took the superblock in the meantime */
+			continue;
+		}
+		lockHeap(heapNum);
+		if (heapNum == pMySuperblock->ownerHeap)
+		{
+			break;
+		}
+		/* the superblock moved while we waited for the lock. The owner can only change with the owner's lock held, so retry */
+		unlockHeap(heapNum);
+	}
+	lockClass(heapNum, pMySuperblock->sizeClass);
+	
+	if (!pBlockHeader->inUse)
+	{
+		unlockHeap(heapNum);
+		unlockClass(heapNum, pMySuperblock->sizeClass);
+		return;
+	}
+	
+		
+	pBlockHeader->inUse = BLOCK_FREE;
+	/* attach this block to the head of the free list */	
+	pBlockHeader->pNextFree = pMySuperblock->pFreeBlocksHead;
+	pMySuperblock->pFreeBlocksHead = pBlockHeader;
+	pMySuperblock->numFreeBlocks++;
+	countBlocksOut(pMySuperblock->sizeClass, -1);
+	
+	/* keep superblocks ordered by fullness */
+	reorderSuperblockInClass(heapNum, pMySuperblock->sizeClass, pMySuperblock);
+	
+	if (pMySuperblock->numFreeBlocks == pMySuperblock->numBlocks)
+	{
+		/* An empty superblock container, recycle it! */
+		recycleSuperblock(heapNum, RECYCLED_CLASS, pMySuperblock);
+	}
+	
+	updateMemoryUsed(heapNum, (-1)*pMySuperblock->blockSize);
+	s_hoard.heapArray[heapNum].numFrees++;
+	if (s_config.maintenanceMs)
+	{
+		/* leave it to the maintenance thread */
+		s_hoard.heapArray[heapNum].needsMaintenance = 1;
+	}
+	else
+	{
+		/* Check heap invariants, if necessary move superblock to global heap */
+		checkInvariantAndMoveSuperblocks(heapNum);
+	}
+	
+	unlockHeap(heapNum);
+	unlockClass(heapNum, pMySuperblock->sizeClass);
+}
+
+/* return a block to a superblock the global heap owns. Only the superblock is locked - it may sit on a global stack
+or be in the middle of being popped by a heap. Returns 0 if the superblock is no longer owned by the global heap */
+static int freeBlockToGlobal(tBlockHeader *pBlockHeader)
+{
+	tSuperblock		*pMySuperblock = pBlockHeader->pMySuperblock;
+	
+	pthread_mutex_lock(&pMySuperblock->mutex);
+	if (GLOBAL_HEAP != pMySuperblock->ownerHeap)
+	{
+		pthread_mutex_unlock(&pMySuperblock->mutex);
+		return 0;
+	}
+	
+	if (pBlockHeader->inUse)
+	{
+		/* The superblock can't be unlinked from the middle of a lock-free stack, so even if it is completely empty now
+		it stays where it is. Whoever pops it next gets an empty superblock of this size class */
+		pBlockHeader->inUse = BLOCK_FREE;
+		pBlockHeader->pNextFree = pMySuperblock->pFreeBlocksHead;
+		pMySuperblock->pFreeBlocksHead = pBlockHeader;
+		pMySuperblock->numFreeBlocks++;
+		countBlocksOut(pMySuperblock->sizeClass, -1);
+		updateMemoryUsed(GLOBAL_HEAP, (-1)*pMySuperblock->blockSize);
+	}
+	
+	pthread_mutex_unlock(&pMySuperblock->mutex);
+	return 1;
+}
+
+/* The count is shared by all heaps, so it is atomic. Blocks move in and out of cpu caches in batches, so with the caches it is
+updated about once a batch, not on every malloc and free */
+static void		countBlocksOut(unsigned int sizeClass, long num)
+{
+	tClassCount		*pCount = &s_hoard.classCounts[sizeClass];
+	unsigned long	numOut, peak;
+
+	numOut = __atomic_add_fetch(&pCount->numBlocksOut, num, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&pCount->peakBlocksOut, __ATOMIC_RELAXED);
+	while (num > 0 && numOut > peak &&
+			!__atomic_compare_exchange_n(&pCount->peakBlocksOut, &peak, numOut, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+}
+
+/*
+
+The realloc() function changes the size of the memory block pointed to by ptr to size bytes. 
+The contents will be unchanged in the range from the start of the region up to the minimum 
+of the old and new sizes. If the new size is larger than the old size, the added memory 
+will not be initialized. If ptr is NULL, then the call is equivalent to malloc(size), 
+for all values of size; if size is equal to zero, and ptr is not NULL, then the call 
+is equivalent to free(ptr). Unless ptr is NULL, it must have been returned by an earlier 
+call to malloc(), calloc() or realloc(). If the area pointed to was moved, a free(ptr) is done. 
+
+
+1. allocate sz bytes
+2. copy from old location to a new one
+3. free old allocation
+*/
+void * realloc (void * ptr, size_t sz) 
+{
+	void			*p = 0;
+	tBlockHeader	*pBlockHeader;
+	size_t			originalSize;
+	size_t			sizeToCopy;
+	
+	DBG_MSG("realloc ptr 0x%x requested size: %d\n", (unsigned int)ptr, sz);
+
+	/*If ptr is NULL, then the call is equivalent to malloc(size)*/
+	if (!ptr)
+	{
+		return malloc(sz);
+	}
+	
+	/*if size is equal to zero, and ptr is not NULL, then the call is equivalent to free(ptr) */
+	if(!sz)
+	{
+		free(ptr);
+		return 0;
+	}
+
+	pBlockHeader = (tBlockHeader *)(ptr - sizeof(tBlockHeader));
+	originalSize = pBlockHeader->size;
+	if (sz <= originalSize && sz > originalSize / 2)
+	{
+		/* still fits, and a new block wouldn't be much smaller - for a small or medium block it would be the same size. Growing
+		buffers that ask for a little more each time only copy when they outgrow the block */
+		if (BLOCK_IN_USE == pBlockHeader->inUse && pBlockHeader->pMySuperblock)
+		{
+			pBlockHeader->requestedSize = (unsigned int)sz;
+		}
+		return ptr;
+	}
+	sizeToCopy = sz > originalSize? originalSize:sz;
+	
+	p = malloc(sz);
+	if (!p)
+	{
+		return 0;
+	}
+	
+	if ( p != memcpy(p,ptr,sizeToCopy))
+	{
+		/* something went wrong during the copy.. */
+		return 0;
+	}
+	/* just free the original pointer and return the new one */
+	free(ptr);
+	
+	DBG_MSG("realloc'd %d bytes at p=0x%x\n", sz,(unsigned int)ptr);
+	DBG_DUMP("end realloc");
+	return p;	
+}
+
+/*
+The usable size of a block - its size class, or what is left of it after an aligned object's offset
+*/
+size_t malloc_usable_size(void *ptr)
+{
+	if (!ptr)
+	{
+		return 0;
+	}
+	return ((tBlockHeader *)(ptr - sizeof(tBlockHeader)))->size;
+}
+
+size_t mtmm_usable_size(void *ptr)
+{
+	return malloc_usable_size(ptr);
+}
+
+/*
+The usable size malloc(sz) would give - the size class, the medium block less its header, or whole pages. Works out the same
+numbers as the allocation paths, but takes no lock and allocates nothing. An answer that would reach the next tier's threshold is
+capped just below it - malloc(32768) is a 64KB medium block - so malloc(mtmm_good_size(sz)) gets the block the answer came from
+*/
+size_t mtmm_good_size(size_t sz)
+{
+	unsigned int	sizeClass;
+	size_t			mapSize, blockSize;
+
+	if (mallocInit == __atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE))
+	{
+		/* the thresholds may come from MTMM_CONF */
+		free(malloc(1));
+	}
+	if (sz < s_config.hoardThreshold)
+	{
+		getSizeClass(sz ? sz : 1, &sizeClass);
+		return ((size_t)1 << sizeClass) < s_config.hoardThreshold ? (size_t)1 << sizeClass : s_config.hoardThreshold - 1;
+	}
+	if (sz < s_config.mmapThreshold)
+	{
+		blockSize = ((size_t)1 << getMediumOrder(sz)) - sizeof(tBlockHeader);
+		return blockSize < s_config.mmapThreshold ? blockSize : s_config.mmapThreshold - 1;
+	}
+	mapSize = getLargeMapSize(sz);
+	return mapSize ? mapSize - sizeof(tBlockHeader) : sz;
+}
+
+/*
+malloc that tells how much was granted, see mtmm.h
+*/
+void * mtmm_malloc_at_least(size_t sz, size_t *pUsable)
+{
+	void			*p = malloc(sz);
+
+	if (pUsable)
+	{
+		*pUsable = malloc_usable_size(p);
+	}
+	return p;
+}
+
+void * reallocarray(void *ptr, size_t num, size_t sz)
+{
+	if (sz && num > ((size_t)-1) / sz)
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+	return realloc(ptr, num*sz);
+}
+
+/*
+Hand every completely empty superblock and medium chunk of the heaps to the global heap, and purge all idle memory right away instead
+of after MAINTENANCE_DECAY_TICKS. Blocks parked in the cpu caches still count as in use. pad is ignored - there is no heap top to keep.
+Returns 1 if any memory went back to the OS
+*/
+int malloc_trim(size_t pad)
+{
+	if (mallocInit == __atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	return trimHeaps() > 0;
+}
+
+static unsigned int	trimHeaps(void)
+{
+	tHeap			*pHeap;
+	tSuperblock		*pSuperblock, *pNext, *pKeep;
+	tMediumChunk	*pChunk, *pNextChunk;
+	unsigned int	heap, sizeClass, node, numReleased = 0;
+	int				isEmpty;
+
+	for (heap = 1; heap < s_config.numHeaps; heap++)
+	{
+		pHeap = &s_hoard.heapArray[heap];
+		lockHeap(heap);
+		for (sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++)
+		{
+			for (pSuperblock = pHeap->sizeClasses[sizeClass].pHead; pSuperblock; pSuperblock = pNext)
+			{
+				pNext = pSuperblock->pNext;
+				if (RECYCLED_CLASS != sizeClass && pSuperblock->numFreeBlocks != pSuperblock->numBlocks)
+				{
+					continue;
+				}
+				if (RECYCLED_CLASS != sizeClass)
+				{
+					recycleSuperblock(heap, RECYCLED_CLASS, pSuperblock);
+				}
+				moveSuperblockToGlobal(heap, pSuperblock);
+			}
+		}
+		for (pChunk = pHeap->pMediumChunks; pChunk; pChunk = pNextChunk)
+		{
+			pNextChunk = pChunk->pNext;
+			if (pChunk->numFreeUnits == MEDIUM_UNITS)
+			{
+				releaseMediumChunk(pHeap, pChunk);
+				pHeap->numEmptyMediumChunks--;
+				numReleased++;
+			}
+		}
+		unlockHeap(heap);
+	}
+
+	/* superblocks the global heap got in their size class and that emptied out there can't be unlinked from the middle of
+	a stack. Go through the whole stack and move the empty ones to the empty pool, so they can be purged */
+	for (node = 0; node < s_hoard.numNodes; node++)
+	{
+		for (sizeClass = 0; sizeClass < RECYCLED_CLASS; sizeClass++)
+		{
+			pKeep = NULL;
+			while ((pSuperblock = popGlobalSuperblock(&s_hoard.globalStacks[node][sizeClass])))
+			{
+				pthread_mutex_lock(&pSuperblock->mutex);
+				isEmpty = (pSuperblock->numFreeBlocks == pSuperblock->numBlocks);
+				if (isEmpty)
+				{
+					/* keeps its old blocks, like any recycled superblock, until a heap carves it for a size class */
+					pSuperblock->sizeClass = RECYCLED_CLASS;
+				}
+				pthread_mutex_unlock(&pSuperblock->mutex);
+				if (isEmpty)
+				{
+					markSuperblockIdle(pSuperblock);
+					pushGlobalSuperblock(getEmptyStack(pSuperblock), pSuperblock);
+				}
+				else
+				{
+					pSuperblock->pNext = pKeep;
+					pKeep = pSuperblock;
+				}
+			}
+			for (pSuperblock = pKeep; pSuperblock; pSuperblock = pNext)
+			{
+				pNext = pSuperblock->pNext;
+				pushGlobalSuperblock(&s_hoard.globalStacks[node][sizeClass], pSuperblock);
+			}
+		}
+	}
+
+	numReleased += maintainRegions(0);
+	return numReleased;
+}
+
+/*
+glibc's statistics, as far as they apply. arena is the memory mapped for superblocks and medium chunks, uordblks what of it is in use
+(arena and object cache memory counts as free) and fordblks the rest. hblks and hblkhd are the large chunks with their own mmap
+*/
+struct mallinfo2 mallinfo2(void)
+{
+	struct mallinfo2	info;
+	tMediumChunk		*pChunk;
+	unsigned int		heap;
+
+	memset(&info, 0, sizeof(info));
+	if (mallocInit == __atomic_load_n(&mallocFunc, __ATOMIC_ACQUIRE))
+	{
+		return info;
+	}
+	info.arena = (size_t)__atomic_load_n(&s_hoard.numRegions, __ATOMIC_RELAXED) * REGION_SIZE +
+				(size_t)__atomic_load_n(&s_hoard.numMediumChunks, __ATOMIC_RELAXED) * MEDIUM_CHUNK_SIZE;
+	for (heap = 0; heap < s_config.numHeaps; heap++)
+	{
+		info.uordblks += __atomic_load_n(&s_hoard.heapArray[heap].statMemoryInUse, __ATOMIC_RELAXED);
+		lockHeap(heap);
+		for (pChunk = s_hoard.heapArray[heap].pMediumChunks; pChunk; pChunk = pChunk->pNext)
+		{
+			info.uordblks += (size_t)(MEDIUM_UNITS - pChunk->numFreeUnits) << MEDIUM_MIN_ORDER;
+		}
+		unlockHeap(heap);
+	}
+	info.fordblks = info.arena > info.uordblks ? info.arena - info.uordblks : 0;
+	info.hblks = __atomic_load_n(&s_hoard.numLargeChunks, __ATOMIC_RELAXED);
+	info.hblkhd = __atomic_load_n(&s_hoard.largeChunkBytes, __ATOMIC_RELAXED);
+	return info;
+}
+
+static void *	allocateLargeMemoryChunk(size_t	sz)
+{
+	void			*p;
+	size_t			mapSize = getLargeMapSize(sz);
+
+	DBG_ENTRY	
+	if (!mapSize)
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+	/* the rest of the last page is the object's too - realloc and mtmm_malloc_at_least can use it */
+	sz = mapSize - sizeof(tBlockHeader);
+	t_overBudget = 0;
+	if (!chargeFootprint(mapSize, 1))
+	{
+		if (!retryOverBudget())
+		{
+			return 0;
+		}
+		p = allocateLargeMemoryChunk(sz);
+		t_budgetRetry = 0;
+		return p;
+	}
+	if (__atomic_load_n(&s_hoard.underPressure, __ATOMIC_RELAXED) && !s_config.maintenanceMs)
+	{
+		/* make room before mapping - large chunks are never cached, so this is the time */
+		relievePressure();
+	}
+	/* anonymous - a preloaded allocator can't count on /dev/zero being there */
+	p = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED){
+		creditFootprint(mapSize);
+		return 0;
+	}
+	__atomic_add_fetch(&s_hoard.numLargeChunks, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s_hoard.largeChunkBytes, mapSize, __ATOMIC_RELAXED);
+
+#ifdef MADV_HUGEPAGE
+	if (s_hoard.useHugepages && sz >= HUGEPAGE_SIZE)
+	{
+		/* only a hint - the kernel backs the huge page aligned part of the chunk */
+		madvise(p, mapSize, MADV_HUGEPAGE);
+	}
+#endif
+
+	((tBlockHeader *) p) -> size = sz;
+	((tBlockHeader *) p) -> pMyChunk = 0;
+
+	DBG_EXIT
+	return (p + sizeof(tBlockHeader));	
+}
+
+static void deallocateLargeMemoryChunk(void * ptr, size_t sz)
+{
+	DBG_ENTRY
+	
+	if (munmap(ptr - sizeof(tBlockHeader), sz) < 0)
+	{
+		perror(NULL);
+	}
+	__atomic_sub_fetch(&s_hoard.numLargeChunks, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&s_hoard.largeChunkBytes, sz, __ATOMIC_RELAXED);
+	creditFootprint(sz);
+
+	DBG_EXIT
+}
+
+static unsigned int	getMediumOrder(size_t sz)
+{
+	unsigned int	order = MEDIUM_MIN_ORDER;
+
+	while (((size_t)1 << order) < sz + sizeof(tBlockHeader))
+	{
+		order++;
+	}
+	return order;
+}
+
+static size_t	getLargeMapSize(size_t sz)
+{
+	if (sz > (size_t)-1 - sizeof(tBlockHeader) - s_hoard.pageSize)
+	{
+		return 0;
+	}
+	return (sz + sizeof(tBlockHeader) + s_hoard.pageSize - 1) & ~(s_hoard.pageSize - 1);
+}
+
+/* Allocate a medium block from the current thread's heap. First fit over the heap's chunks, oldest first, so the newer
+chunks get a chance to become completely free again */
+static void *	allocMediumBlock(size_t sz)
+{
+	tMediumChunk	*pChunk, *pLast = 0;
+	unsigned int	heapNum, order;
+	void			*p = 0;
+
+	DBG_ENTRY
+	order = getMediumOrder(sz);
+	if (!getHeapNumber(&heapNum))
+	{
+		return 0;
+	}
+	t_overBudget = 0;
+
+	lockHeap(heapNum);
+	for (pChunk = s_hoard.heapArray[heapNum].pMediumChunks; pChunk && !p; pChunk = pChunk->pNext)
+	{
+		p = allocFromMediumChunk(pChunk, order);
+		pLast = pChunk;
+	}
+	if (!p)
+	{
+		pChunk = createMediumChunk(heapNum);
+		if (pChunk)
+		{
+			/* append, keeping the list oldest first */
+			pChunk->pPrev = pLast;
+			pChunk->pNext = 0;
+			if (pLast)
+			{
+				pLast->pNext = pChunk;
+			}
+			else
+			{
+				s_hoard.heapArray[heapNum].pMediumChunks = pChunk;
+			}
+			s_hoard.heapArray[heapNum].numEmptyMediumChunks++;
+			p = allocFromMediumChunk(pChunk, order);
+		}
+	}
+	unlockHeap(heapNum);
+
+	if (!p)
+	{
+		if (!retryOverBudget())
+		{
+			return 0;
+		}
+		p = allocMediumBlock(sz);
+		t_budgetRetry = 0;
+		return p;
+	}
+	if (__atomic_load_n(&s_hoard.underPressure, __ATOMIC_RELAXED) && !s_config.maintenanceMs)
+	{
+		relievePressure();
+	}
+	DBG_MSG("medium block 0x%X order %d heap %d\n", (unsigned int)p, order, heapNum);
+	DBG_EXIT
+	return p;
+}
+
+/* Take a block of the given order from a chunk, splitting a bigger free block if there is no free block of that order.
+The caller holds the owner heap's lock. NULL if the chunk has no block big enough */
+static void *	allocFromMediumChunk(tMediumChunk *pChunk, unsigned int order)
+{
+	unsigned int	level, wanted = order - MEDIUM_MIN_ORDER, unit;
+	tBlockHeader	*pBlockHeader;
+
+	for (level = wanted; level < NUM_MEDIUM_ORDERS && !pChunk->freeMap[level]; level++)
+	{
+	}
+	if (level == NUM_MEDIUM_ORDERS)
+	{
+		return 0;
+	}
+
+	unit = __builtin_ctzll(pChunk->freeMap[level]);
+	pChunk->freeMap[level] &= ~(1ULL << unit);
+	/* split - the upper half of each split block is the free buddy of the lower half */
+	while (level > wanted)
+	{
+		level--;
+		pChunk->freeMap[level] |= 1ULL << (unit + (1U << level));
+	}
+
+	if (pChunk->numFreeUnits == MEDIUM_UNITS)
+	{
+		s_hoard.heapArray[pChunk->ownerHeap].numEmptyMediumChunks--;
+	}
+	pChunk->numFreeUnits -= 1U << wanted;
+
+	pBlockHeader = (tBlockHeader *)(pChunk->pBase + ((size_t)unit << MEDIUM_MIN_ORDER));
+	pBlockHeader->inUse = BLOCK_IN_USE;
+	pBlockHeader->size = ((size_t)1 << order) - sizeof(tBlockHeader);
+	pBlockHeader->pMyChunk = pChunk;
+	pBlockHeader->pMySuperblock = 0;
+	return (void *)pBlockHeader + sizeof(tBlockHeader);
+}
+
+/* Return a medium block to its chunk, coalescing it with its free buddies. A heap keeps up to MAX_EMPTY_MEDIUM_CHUNKS
+completely free chunks so a thread allocating and freeing a medium object in a loop doesn't fault in fresh pages every time.
+Further free chunks are purged and left for any heap to take */
+static void		freeMediumBlock(tBlockHeader *pBlockHeader)
+{
+	tMediumChunk	*pChunk = pBlockHeader->pMyChunk;
+	tHeap			*pHeap;
+	unsigned int	heapNum, level, unit;
+
+	DBG_ENTRY
+	/* the chunk can't change hands while this block is in use, so the owner is stable */
+	heapNum = pChunk->ownerHeap;
+	pHeap = &s_hoard.heapArray[heapNum];
+	lockHeap(heapNum);
+
+	if (BLOCK_IN_USE != pBlockHeader->inUse)
+	{
+		/* freed twice */
+		unlockHeap(heapNum);
+		return;
+	}
+	pBlockHeader->inUse = BLOCK_FREE;
+
+	unit = ((void *)pBlockHeader - pChunk->pBase) >> MEDIUM_MIN_ORDER;
+	level = 0;
+	while ((((size_t)1 << (level + MEDIUM_MIN_ORDER)) - sizeof(tBlockHeader)) != pBlockHeader->size)
+	{
+		level++;
+	}
+	pChunk->numFreeUnits += 1U << level;
+
+	/* merge with the buddy for as long as it is free as a whole */
+	while (level < NUM_MEDIUM_ORDERS - 1 && (pChunk->freeMap[level] & (1ULL << (unit ^ (1U << level)))))
+	{
+		pChunk->freeMap[level] &= ~(1ULL << (unit ^ (1U << level)));
+		unit &= ~(1U << level);
+		level++;
+	}
+	pChunk->freeMap[level] |= 1ULL << unit;
+
+	if (pChunk->numFreeUnits == MEDIUM_UNITS)
+	{
+		if (pHeap->numEmptyMediumChunks < MAX_EMPTY_MEDIUM_CHUNKS)
+		{
+			pHeap->numEmptyMediumChunks++;
+		}
+		else
+		{
+			releaseMediumChunk(pHeap, pChunk);
+		}
+	}
+	unlockHeap(heapNum);
+	DBG_EXIT
+}
+
+/* Get a completely free chunk for a heap - a purged one of the heap's node if there is any, otherwise a new one from the OS.
+Only if the OS has no more, a purged one of another node */
+static tMediumChunk *	createMediumChunk(unsigned int heapNum)
+{
+	tMediumChunk	*pChunk, **ppChunk;
+	unsigned int	isHuge, node = s_hoard.heapNodes[heapNum];
+
+	if (!chargeFootprint(MEDIUM_CHUNK_SIZE, 1))
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&s_hoard.regionMutex);
+	for (ppChunk = &s_hoard.pFreeMediumChunks; *ppChunk && (*ppChunk)->node != node; ppChunk = &(*ppChunk)->pNext);
+	pChunk = *ppChunk;
+	if (pChunk)
+	{
+		*ppChunk = pChunk->pNext;
+	}
+	pthread_mutex_unlock(&s_hoard.regionMutex);
+
+	if (!pChunk)
+	{
+		/* the descriptor is kept apart from the chunk memory, like the region descriptors */
+		pChunk = mmap(0, sizeof(tMediumChunk), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pChunk != MAP_FAILED && !(pChunk->pBase = mapAlignedMemory(MEDIUM_CHUNK_SIZE, &isHuge)))
+		{
+			munmap(pChunk, sizeof(tMediumChunk));
+			pChunk = MAP_FAILED;
+		}
+		if (pChunk != MAP_FAILED)
+		{
+			bindToNode(pChunk->pBase, MEDIUM_CHUNK_SIZE, node);
+			pChunk->node = node;
+			__atomic_add_fetch(&s_hoard.numMediumChunks, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			pthread_mutex_lock(&s_hoard.regionMutex);
+			pChunk = s_hoard.pFreeMediumChunks;
+			if (pChunk)
+			{
+				s_hoard.pFreeMediumChunks = pChunk->pNext;
+			}
+			pthread_mutex_unlock(&s_hoard.regionMutex);
+			if (!pChunk)
+			{
+				creditFootprint(MEDIUM_CHUNK_SIZE);
+				return 0;
+			}
+		}
+	}
+
+	pChunk->ownerHeap = heapNum;
+	pChunk->numFreeUnits = MEDIUM_UNITS;
+	memset(pChunk->freeMap, 0, sizeof(pChunk->freeMap));
+	/* one free block spanning the whole chunk */
+	pChunk->freeMap[NUM_MEDIUM_ORDERS - 1] = 1;
+	return pChunk;
+}
+
+/* Take a completely free chunk out of its heap, purge it and put it on the list of free chunks. The memory faults back in zeroed on reuse */
+static void		releaseMediumChunk(tHeap *pHeap, tMediumChunk *pChunk)
+{
+	if (pChunk->pPrev)
+	{
+		pChunk->pPrev->pNext = pChunk->pNext;
+	}
+	else
+	{
+		pHeap->pMediumChunks = pChunk->pNext;
+	}
+	if (pChunk->pNext)
+	{
+		pChunk->pNext->pPrev = pChunk->pPrev;
+	}
+
+	madvise(pChunk->pBase, MEDIUM_CHUNK_SIZE, MADV_DONTNEED);
+	creditFootprint(MEDIUM_CHUNK_SIZE);
+
+	pthread_mutex_lock(&s_hoard.regionMutex);
+	pChunk->pPrev = 0;
+	pChunk->pNext = s_hoard.pFreeMediumChunks;
+	s_hoard.pFreeMediumChunks = pChunk;
+	pthread_mutex_unlock(&s_hoard.regionMutex);
+}
+
+static int		getHeapNumber(unsigned int *pHeapNumber)
+{
+	pthread_t         self;
+	unsigned int      node;
+	
+	if (t_heapNum < 0)
+	{
+		self = pthread_self();
+		DBG_MSG("self =  0x%.8x\n", (unsigned int)self);
+		
+		/* trying to reduce the probability that two threads will use the same heap. Only the heaps of our node will do */
+		node = getCurrentNode();
+		t_heapNum = ((self >> 12) % s_hoard.numNodeHeaps[node]) + s_hoard.firstNodeHeap[node];
+		__atomic_add_fetch(&s_hoard.heapArray[t_heapNum].numThreads, 1, __ATOMIC_RELAXED);
+		/* any value but NULL, so that the destructor runs when the thread exits */
+		pthread_setspecific(s_hoard.threadKey, (void *)1);
+	}
+	else if (++t_heapOps >= HEAP_REBALANCE_PERIOD)
+	{
+		/* the hash may have put us together with a busy thread. If that keeps happening, move. Move as well if the scheduler
+		moved us to another node */
+		if (t_heapContention >= HEAP_MIGRATE_CONTENTION ||
+			(s_hoard.numNodes > 1 && s_hoard.heapNodes[t_heapNum] != getCurrentNode()))
+		{
+			migrateHeap();
+		}
+		t_heapOps = 0;
+		t_heapContention = 0;
+	}
+	
+	*pHeapNumber = t_heapNum;
+	return 1;	
+}
+
+/* move the current thread to the heap with the fewest threads */
+static void		migrateHeap(void)
+{
+	unsigned int	heap, bestHeap, bestLoad, load, node;
+	
+	/* the threads we would leave behind - unless our heap is on another node, then any heap of this node is better */
+	node = getCurrentNode();
+	bestHeap = t_heapNum;
+	bestLoad = s_hoard.heapNodes[t_heapNum] == node ? s_hoard.heapArray[t_heapNum].numThreads - 1 : (unsigned int)-1;
+	
+	for (heap = s_hoard.firstNodeHeap[node]; heap < s_hoard.firstNodeHeap[node] + s_hoard.numNodeHeaps[node]; heap++)
+	{
+		load = __atomic_load_n(&s_hoard.heapArray[heap].numThreads, __ATOMIC_RELAXED);
+		if (load < bestLoad)
+		{
+			bestHeap = heap;
+			bestLoad = load;
+		}
+	}
+	
+	if (bestHeap != t_heapNum)
+	{
+		DBG_MSG("thread moves from heap %d to heap %d\n", t_heapNum, bestHeap);
+		__atomic_sub_fetch(&s_hoard.heapArray[t_heapNum].numThreads, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s_hoard.heapArray[bestHeap].numThreads, 1, __ATOMIC_RELAXED);
+		t_heapNum = bestHeap;
+	}
+}
+
+/* The nodes are the online nodes in sysfs that have cpus - a node of memory only has no threads to own heaps. MTMM_NUMA replaces
+them with made up nodes: cpu lists separated by slashes, like 0-3,8-11/4-7,12-15. Cpus no node lists are on node 0. The heaps
+are split between the nodes as evenly as they go, heap 1 and up on node 0, then node 1 and so on */
+static void		loadTopology(void)
+{
+	char			buffer[4096];
+	char			path[64];
+	unsigned char	isOnline[64];
+	unsigned char	isOnNode[MAX_CPUS];
+	const char		*pList;
+	unsigned int	node, id, cpu, numNodes = 0, numHeaps = s_config.numHeaps - 1;
+	int				fd, isAnyCpu;
+	ssize_t			n;
+
+	memset(s_hoard.cpuNodes, 0, sizeof(s_hoard.cpuNodes));
+	pList = getenv("MTMM_NUMA");
+	if (pList)
+	{
+		while (numNodes < MAX_NODES && *pList)
+		{
+			memset(isOnNode, 0, sizeof(isOnNode));
+			pList = parseIdList(pList, isOnNode, MAX_CPUS);
+			for (cpu = 0; cpu < MAX_CPUS; cpu++)
+			{
+				if (isOnNode[cpu])
+				{
+					s_hoard.cpuNodes[cpu] = numNodes;
+				}
+			}
+			/* made up nodes bind nowhere - mbind fails for nodes that don't exist, and the memory stays where it faults in */
+			s_hoard.nodeIds[numNodes] = numNodes;
+			numNodes++;
+			if ('/' != *pList)
+			{
+				break;
+			}
+			pList++;
+		}
+	}
+	else
+	{
+		/* open and read, not stdio - stdio would call malloc, and the heaps aren't there yet */
+		memset(isOnline, 0, sizeof(isOnline));
+		fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			n = read(fd, buffer, sizeof(buffer) - 1);
+			close(fd);
+			if (n > 0)
+			{
+				buffer[n] = 0;
+				parseIdList(buffer, isOnline, sizeof(isOnline));
+			}
+		}
+		for (id = 0; id < sizeof(isOnline) && numNodes < MAX_NODES; id++)
+		{
+			snprintf(path, sizeof(path), NODE_SYSFS_PATH, id);
+			if (!isOnline[id] || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			{
+				continue;
+			}
+			n = read(fd, buffer, sizeof(buffer) - 1);
+			close(fd);
+			if (n <= 0)
+			{
+				continue;
+			}
+			buffer[n] = 0;
+			memset(isOnNode, 0, sizeof(isOnNode));
+			parseIdList(buffer, isOnNode, MAX_CPUS);
+			for (cpu = 0, isAnyCpu = 0; cpu < MAX_CPUS; cpu++)
+			{
+				if (isOnNode[cpu])
+				{
+					s_hoard.cpuNodes[cpu] = numNodes;
+					isAnyCpu = 1;
+				}
+			}
+			if (isAnyCpu)
+			{
+				s_hoard.nodeIds[numNodes++] = id;
+			}
+		}
+	}
+
+	/* a node needs a heap of its own to make a difference */
+	if (numNodes < 2 || numHeaps < numNodes)
+	{
+		numNodes = 1;
+		memset(s_hoard.cpuNodes, 0, sizeof(s_hoard.cpuNodes));
+	}
+	s_hoard.numNodes = numNodes;
+	for (node = 0; node < numNodes; node++)
+	{
+		s_hoard.firstNodeHeap[node] = 1 + node * numHeaps / numNodes;
+		s_hoard.numNodeHeaps[node] = 1 + (node + 1) * numHeaps / numNodes - s_hoard.firstNodeHeap[node];
+		for (id = s_hoard.firstNodeHeap[node]; id < s_hoard.firstNodeHeap[node] + s_hoard.numNodeHeaps[node]; id++)
+		{
+			s_hoard.heapNodes[id] = node;
+		}
+	}
+	DBG_MSG("%d numa nodes\n", numNodes);
+}
+
+static const char *	parseIdList(const char *pList, unsigned char *pIsListed, unsigned int maxId)
+{
+	unsigned long	first, last, id;
+	char			*pEnd;
+
+	while (*pList >= '0' && *pList <= '9')
+	{
+		first = strtoul(pList, &pEnd, 10);
+		last = first;
+		if ('-' == *pEnd)
+		{
+			last = strtoul(pEnd + 1, &pEnd, 10);
+		}
+		for (id = first; id <= last && id < maxId; id++)
+		{
+			pIsListed[id] = 1;
+		}
+		pList = pEnd;
+		if (',' == *pList)
+		{
+			pList++;
+		}
+	}
+	return pList;
+}
+
+static unsigned int	getCurrentNode(void)
+{
+	unsigned int	cpu;
+
+	if (1 == s_hoard.numNodes)
+	{
+		return 0;
+	}
+	/* without rseq, ask the kernel - only once per thread and then every HEAP_REBALANCE_PERIOD trips to the heap */
+	if (!getCpuNumber(&cpu) && (syscall(SYS_getcpu, &cpu, NULL, NULL) || cpu >= MAX_CPUS))
+	{
+		return 0;
+	}
+	return s_hoard.cpuNodes[cpu];
+}
+
+static unsigned int	getThreadNode(void)
+{
+	unsigned int	heapNum;
+
+	return getHeapNumber(&heapNum) ? s_hoard.heapNodes[heapNum] : 0;
+}
+
+/* Preferred, not strict - when the node runs out of memory the kernel takes it from another one instead of failing the fault */
+static void		bindToNode(void *p, size_t size, unsigned int node)
+{
+#ifdef SYS_mbind
+	unsigned long	nodeMask;
+
+	if (s_hoard.numNodes > 1)
+	{
+		nodeMask = 1UL << s_hoard.nodeIds[node];
+		syscall(SYS_mbind, p, size, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask) * 8, 0);
+	}
+#endif
+}
+
+static tSuperblockStack *	getGlobalStack(tSuperblock *pSuperblock, unsigned int sizeClass)
+{
+	return &s_hoard.globalStacks[pSuperblock->pRegion->node][sizeClass];
+}
+
+static tSuperblockStack *	getEmptyStack(tSuperblock *pSuperblock)
+{
+	return &s_hoard.emptyStacks[pSuperblock->pRegion->node][pSuperblock->spanOrder - MIN_SPAN_ORDER];
+}
+
+/* Nearest node first would be better, but the kernel's distance table isn't worth reading for MAX_NODES nodes - just go round */
+static tSuperblock *	popRemoteSuperblock(unsigned int node, unsigned int sizeClass)
+{
+	tSuperblock		*pSuperblock = 0;
+	unsigned int	i, remote;
+
+	for (i = 1; i < s_hoard.numNodes && !pSuperblock; i++)
+	{
+		remote = (node + i) % s_hoard.numNodes;
+		if (!(pSuperblock = popGlobalSuperblock(&s_hoard.globalStacks[remote][sizeClass])))
+		{
+			pSuperblock = popEmptySuperblock(remote, s_hoard.spanOrders[sizeClass]);
+		}
+	}
+	return pSuperblock;
+}
+
+/* Thread exit destructor. A heap that still has threads keeps its memory - they will use it. The last thread to leave
+hands everything to the global heap, partly full superblocks included, so a pool that keeps replacing its threads
+doesn't strand memory in heaps nobody allocates from any more. Empty medium chunks go back to the shared pool. Medium
+chunks with blocks in use stay with the heap - frees of those blocks still find it */
+static void		releaseThreadHeap(void *pArg)
+{
+	tHeap			*pHeap;
+	tSuperblock		*pSuperblock;
+	tMediumChunk	*pChunk, *pNextChunk;
+	unsigned int	heapNum, sizeClass;
+	
+	flushThreadMagazines();
+	if (t_heapNum < 0)
+	{
+		return;
+	}
+	heapNum = t_heapNum;
+	pHeap = &s_hoard.heapArray[heapNum];
+	/* frees from later destructors of this thread pick a heap again */
+	t_heapNum = -1;
+	if (__atomic_sub_fetch(&pHeap->numThreads, 1, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	DBG_MSG("last thread left heap %d\n", heapNum);
+	
+	lockHeap(heapNum);
+	for (sizeClass = 0; sizeClass < NUM_SIZE_CLASSES; sizeClass++)
+	{
+		while ((pSuperblock = pHeap->sizeClasses[sizeClass].pHead))
+		{
+			if (RECYCLED_CLASS != sizeClass && pSuperblock->numFreeBlocks == pSuperblock->numBlocks)
+			{
+				/* refilled but never used - give it back as empty, so any class of its span can use it and it can be purged */
+				recycleSuperblock(heapNum, RECYCLED_CLASS, pSuperblock);
+			}
+			moveSuperblockToGlobal(heapNum, pSuperblock);
+		}
+		pHeap->sizeClasses[sizeClass].refillBatch = 0;
+		pHeap->sizeClasses[sizeClass].numAllocatedSinceRefill = 0;
+	}
+	for (pChunk = pHeap->pMediumChunks; pChunk; pChunk = pNextChunk)
+	{
+		pNextChunk = pChunk->pNext;
+		if (pChunk->numFreeUnits == MEDIUM_UNITS)
+		{
+			releaseMediumChunk(pHeap, pChunk);
+			pHeap->numEmptyMediumChunks--;
+		}
+	}
+	/* the next thread here starts from the configured f and K */
+	pHeap->emptyThresholdK = s_config.emptyThresholdK;
+	pHeap->fullnessF = s_config.fullnessF;
+	unlockHeap(heapNum);
+}
+
+/* Gets the cpu the current thread runs on from its rseq area. Returns 0 if not known */
+static int		getCpuNumber(unsigned int *pCpuNumber)
+{
+#ifdef HAVE_RSEQ
+	struct rseq		*pRseq;
+	int				cpu;
+	
+	/* the kernel keeps cpu_id up to date on every migration. No system call needed */
+	pRseq = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+	cpu = (int)__atomic_load_n(&pRseq->cpu_id, __ATOMIC_RELAXED);
+	if (cpu < 0 || cpu >= MAX_CPUS)
+	{
+		return 0;
+	}
+	*pCpuNumber = cpu;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+static void		unlockCpuCache(tCpuCache *pCache)
+{
+	__atomic_store_n(&pCache->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Claim a cpu's cache for one operation. Never waits - the holder may be a preempted thread. With rseq sections the cpu is fenced
+as well: a section running there right now is restarted, and every section from now on sees busy and keeps its hands off */
+static int		tryLockCpuCache(unsigned int cpu)
+{
+	tCpuCache		*pCache = &s_hoard.cpuCaches[cpu];
+
+	if (__atomic_exchange_n(&pCache->busy, 1, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+#ifdef HAVE_RSEQ_SECTIONS
+	if (s_hoard.useRseqSections && syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, MEMBARRIER_CMD_FLAG_CPU, cpu))
+	{
+		unlockCpuCache(pCache);
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+#ifdef HAVE_RSEQ_SECTIONS
+/*
+The cpu is read, the cache checked and the block taken, and the last instruction - the store of the new count - commits it all.
+If the thread is preempted, migrated or gets a signal before that, the kernel sends it to the abort handler, which starts over on
+whatever cpu it is on now. The descriptor goes to __rseq_cs and the handler, behind the signature the kernel checks, to
+__rseq_failure. The cache is found by its offset from cpuCaches[0], scaled by the cpu number
+*/
+static tBlockHeader *	popCpuCache(unsigned int sizeClass, tCpuCache **ppCache, unsigned int *pNumLeft)
+{
+	struct rseq		*pRseq = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+	tBlockHeader	*pBlock;
+	uintptr_t		offset;
+	unsigned int	numLeft;
+
+	__asm__ __volatile__ (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n"
+		"3:\n\t"
+		".long 0, 0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n"
+		"0:\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[csOffset](%[rseq])\n"
+		"1:\n\t"
+		"movl %c[cpuOffset](%[rseq]), %%eax\n\t"
+		"cmpl %[maxCpus], %%eax\n\t"
+		"jae 5f\n\t"
+		"imulq %[cacheSize], %%rax, %%rax\n\t"
+		"cmpl $0, (%[busy], %%rax)\n\t"
+		"jne 5f\n\t"
+		"movl (%[num], %%rax), %%ecx\n\t"
+		"testl %%ecx, %%ecx\n\t"
+		"jz 5f\n\t"
+		"leaq (%[blocks], %%rax), %%rdx\n\t"
+		"movq -8(%%rdx, %%rcx, 8), %[block]\n\t"
+		"decl %%ecx\n\t"
+		"movl %%ecx, (%[num], %%rax)\n"
+		"2:\n\t"
+		"jmp 6f\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[sig]\n"
+		"4:\n\t"
+		"jmp 0b\n\t"
+		".popsection\n"
+		"5:\n\t"
+		"xorl %k[block], %k[block]\n"
+		"6:\n"
+		: [block] "=&r" (pBlock), "=&a" (offset), "=&c" (numLeft)
+		: [rseq] "r" (pRseq), [busy] "r" (&s_hoard.cpuCaches[0].busy), [num] "r" (&s_hoard.cpuCaches[0].numBlocks[sizeClass]),
+		  [blocks] "r" (&s_hoard.cpuCaches[0].pBlocks[sizeClass][0]), [csOffset] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpuOffset] "i" (offsetof(struct rseq, cpu_id_start)), [maxCpus] "i" (MAX_CPUS), [cacheSize] "i" (sizeof(tCpuCache)),
+		  [sig] "i" (RSEQ_SIG)
+		: "rdx", "memory", "cc");
+
+	if (pBlock)
+	{
+		*ppCache = (tCpuCache *)((char *)s_hoard.cpuCaches + offset);
+		*pNumLeft = numLeft;
+	}
+	return pBlock;
+}
+
+/* the same for a push. The block goes into the free slot before the count that makes it part of the cache is stored */
+static int		pushCpuCache(tBlockHeader *pBlockHeader, unsigned int sizeClass)
+{
+	struct rseq		*pRseq = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+	int				isPushed;
+
+	__asm__ __volatile__ (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n"
+		"3:\n\t"
+		".long 0, 0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n"
+		"0:\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[csOffset](%[rseq])\n"
+		"1:\n\t"
+		"movl %c[cpuOffset](%[rseq]), %%eax\n\t"
+		"cmpl %[maxCpus], %%eax\n\t"
+		"jae 5f\n\t"
+		"imulq %[cacheSize], %%rax, %%rax\n\t"
+		"cmpl $0, (%[busy], %%rax)\n\t"
+		"jne 5f\n\t"
+		"movl (%[num], %%rax), %%ecx\n\t"
+		"cmpl %[cacheSlots], %%ecx\n\t"
+		"jae 5f\n\t"
+		"leaq (%[blocks], %%rax), %%rdx\n\t"
+		"movq %[block], (%%rdx, %%rcx, 8)\n\t"
+		"incl %%ecx\n\t"
+		"movl %%ecx, (%[num], %%rax)\n"
+		"2:\n\t"
+		"movl $1, %[isPushed]\n\t"
+		"jmp 6f\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[sig]\n"
+		"4:\n\t"
+		"jmp 0b\n\t"
+		".popsection\n"
+		"5:\n\t"
+		"movl $0, %[isPushed]\n"
+		"6:\n"
+		: [isPushed] "=&r" (isPushed)
+		: [block] "r" (pBlockHeader), [rseq] "r" (pRseq), [busy] "r" (&s_hoard.cpuCaches[0].busy),
+		  [num] "r" (&s_hoard.cpuCaches[0].numBlocks[sizeClass]), [blocks] "r" (&s_hoard.cpuCaches[0].pBlocks[sizeClass][0]),
+		  [csOffset] "i" (offsetof(struct rseq, rseq_cs)), [cpuOffset] "i" (offsetof(struct rseq, cpu_id_start)),
+		  [maxCpus] "i" (MAX_CPUS), [cacheSize] "i" (sizeof(tCpuCache)), [cacheSlots] "i" (CPU_CACHE_SIZE), [sig] "i" (RSEQ_SIG)
+		: "rax", "rcx", "rdx", "memory", "cc");
+	return isPushed;
+}
+#endif
+
+/* pop a block of the given size class from the current cpu's cache, refilling the cache from the heap if it ran dry. NULL if no cache to use */
+static void *	allocFromCpuCache(unsigned int sizeClass)
+{
+	tCpuCache		*pCache;
+	tBlockHeader	*pBlock;
+	unsigned int	cpu, heapNum, numRefilled, i;
+	int				isRefilled = 0;
+	void			*p = 0;
+	
+	if (!s_hoard.useCpuCaches)
+	{
+		return 0;
+	}
+#ifdef HAVE_RSEQ_SECTIONS
+	if (s_hoard.useRseqSections)
+	{
+		pBlock = popCpuCache(sizeClass, &pCache, &numRefilled);
+		if (pBlock)
+		{
+			/* the block is ours once the section committed */
+			pBlock->inUse = BLOCK_IN_USE;
+			if (numRefilled)
+			{
+				/* only a hint - the slot may change under us, and a prefetch doesn't fault */
+				PREFETCH_FOR_WRITE(__atomic_load_n(&pCache->pBlocks[sizeClass][numRefilled - 1], __ATOMIC_RELAXED));
+			}
+			if (s_config.maintenanceMs && numRefilled < CPU_CACHE_LOW_WATER)
+			{
+				__atomic_fetch_or(&pCache->lowWater, 1U << sizeClass, __ATOMIC_RELAXED);
+			}
+			return ((void *)pBlock) + sizeof(tBlockHeader);
+		}
+		/* empty or busy - refill under the busy flag */
+	}
+#endif
+	if (!getCpuNumber(&cpu) || !tryLockCpuCache(cpu))
+	{
+		return 0;
+	}
+	pCache = &s_hoard.cpuCaches[cpu];
+	
+	if (!pCache->numBlocks[sizeClass] && getHeapNumber(&heapNum))
+	{
+		/* refill half the cache at once so the next few mallocs on this cpu stay on the fast path */
+		lockHeap(heapNum);
+		numRefilled = allocMemBatch(heapNum, sizeClass, &pCache->pBlocks[sizeClass][pCache->numBlocks[sizeClass]],
+									CPU_CACHE_BATCH - pCache->numBlocks[sizeClass]);
+		unlockHeap(heapNum);
+		for (i = 0; i < numRefilled; i++)
+		{
+			pCache->pBlocks[sizeClass][pCache->numBlocks[sizeClass]++]->inUse = BLOCK_CACHED;
+		}
+		isRefilled = 1;
+	}
+	
+	if (pCache->numBlocks[sizeClass])
+	{
+		pBlock = pCache->pBlocks[sizeClass][--pCache->numBlocks[sizeClass]];
+		pBlock->inUse = BLOCK_IN_USE;
+		p = ((void *)pBlock) + sizeof(tBlockHeader);
+		if (pCache->numBlocks[sizeClass])
+		{
+			PREFETCH_FOR_WRITE(pCache->pBlocks[sizeClass][pCache->numBlocks[sizeClass] - 1]);
+		}
+		if (s_config.maintenanceMs && pCache->numBlocks[sizeClass] < CPU_CACHE_LOW_WATER)
+		{
+			__atomic_fetch_or(&pCache->lowWater, 1U << sizeClass, __ATOMIC_RELAXED);
+		}
+	}
+	
+	unlockCpuCache(pCache);
+	if (isRefilled && __atomic_load_n(&s_hoard.underPressure, __ATOMIC_RELAXED) && !s_config.maintenanceMs)
+	{
+		relievePressure();
+	}
+	return p;
+}
+
+/* push a freed block on the current cpu's cache, flushing part of the cache to the heaps if it is full. Returns 0 if no cache to use */
+static int		freeToCpuCache(tBlockHeader *pBlockHeader, unsigned int sizeClass)
+{
+	tCpuCache		*pCache;
+	unsigned int	cpu, i;
+	
+	if (!s_hoard.useCpuCaches)
+	{
+		return 0;
+	}
+#ifdef HAVE_RSEQ_SECTIONS
+	if (s_hoard.useRseqSections)
+	{
+		/* marked before it is in the cache - the next malloc on this cpu may take it right away */
+		pBlockHeader->inUse = BLOCK_CACHED;
+		if (pushCpuCache(pBlockHeader, sizeClass))
+		{
+			return 1;
+		}
+		/* full or busy - flush under the busy flag */
+	}
+#endif
+	if (!getCpuNumber(&cpu) || !tryLockCpuCache(cpu))
+	{
+		pBlockHeader->inUse = BLOCK_IN_USE;
+		return 0;
+	}
+	pCache = &s_hoard.cpuCaches[cpu];
+	
+	if (pCache->numBlocks[sizeClass] == CPU_CACHE_SIZE)
+	{
+		/* give the oldest (coldest) half back to the heaps and keep the recently freed ones */
+		for (i = 0; i < CPU_CACHE_BATCH; i++)
+		{
+			freeBlock(pCache->pBlocks[sizeClass][i]);
+		}
+		memmove(&pCache->pBlocks[sizeClass][0], &pCache->pBlocks[sizeClass][CPU_CACHE_BATCH],
+				(CPU_CACHE_SIZE - CPU_CACHE_BATCH) * sizeof(tBlockHeader *));
+		pCache->numBlocks[sizeClass] -= CPU_CACHE_BATCH;
+	}
+	
+	pBlockHeader->inUse = BLOCK_CACHED;
+	pCache->pBlocks[sizeClass][pCache->numBlocks[sizeClass]++] = pBlockHeader;
+	
+	unlockCpuCache(pCache);
+	return 1;
+}
+
+/* Get size class by rounding up requested size to next highest power of 2, return that power. */
+static int		getSizeClass    (size_t	requestedSize, unsigned int *pNextPowerOfTwo)
+{
+	/* the same computation as MTMM_SIZE_CLASS in mtmm.h, so inline and out of line allocations agree */
+	*pNextPowerOfTwo = MTMM_SIZE_CLASS(requestedSize);
+	return 1;
+}
+
+static unsigned int	createSuperblocks(unsigned int heapNum, unsigned int sizeClass, tSuperblock **ppSuperblocks, unsigned int numSuperblocks)
+{
+	unsigned int	numCarved, i;
+
+	DBG_ENTRY
+
+	numCarved = carveSuperblocks(s_hoard.heapNodes[heapNum], s_hoard.spanOrders[sizeClass], ppSuperblocks, numSuperblocks);
+	for (i = 0; i < numCarved; i++)
+	{
+		DBG_MSG("p 0x%X\n", (unsigned int)ppSuperblocks[i]->pBlockArray);
+		initSuperblock(heapNum, sizeClass, ppSuperblocks[i]);
+	}
+
+	DBG_EXIT
+	return numCarved;
+}
+
+/* Map a new REGION_SIZE aligned region from the OS on the given node, backed by huge pages if enabled */
+static tRegion *	createRegion(unsigned int node)
+{
+	tRegion		*pRegion;
+
+	DBG_ENTRY
+	if (!chargeFootprint(REGION_SIZE, 1))
+	{
+		return 0;
+	}
+	/* the descriptors are kept apart from the region memory, see tRegion */
+	pRegion = mmap(0, sizeof(tRegion), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pRegion == MAP_FAILED)
+	{
+		creditFootprint(REGION_SIZE);
+		return 0;
+	}
+
+	pRegion->pBase = mapAlignedMemory(REGION_SIZE, &pRegion->isHuge);
+	if (!pRegion->pBase)
+	{
+		munmap(pRegion, sizeof(tRegion));
+		creditFootprint(REGION_SIZE);
+		return 0;
+	}
+	/* before anything touches it */
+	bindToNode(pRegion->pBase, REGION_SIZE, node);
+	pRegion->node = node;
+	DBG_MSG("region 0x%X huge %d\n", (unsigned int)pRegion->pBase, pRegion->isHuge);
+	DBG_EXIT
+	return pRegion;
+}
+
+/* Map size bytes aligned to size, backed by huge pages if enabled. size is a multiple of HUGEPAGE_SIZE */
+static void *	mapAlignedMemory(size_t size, unsigned int *pIsHuge)
+{
+	void		*p, *pAligned;
+	size_t		headSize, tailSize;
+
+	*pIsHuge = 0;
+	/* mmap only guarantees page alignment, so map twice the size and trim the unaligned head and tail */
+	p = mmap(0, 2*size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		return 0;
+	}
+	pAligned = (void *)(((uintptr_t)p + size - 1) & ~((uintptr_t)size - 1));
+	headSize = pAligned - p;
+	tailSize = size - headSize;
+	if (headSize)
+	{
+		munmap(p, headSize);
+	}
+	if (tailSize)
+	{
+		munmap(pAligned + size, tailSize);
+	}
+
+	if (s_hoard.useHugepages)
+	{
+#ifdef MADV_HUGEPAGE
+		if (!madvise(pAligned, size, MADV_HUGEPAGE))
+		{
+			*pIsHuge = 1;
+		}
+#endif
+#ifdef MAP_HUGETLB
+		if (!*pIsHuge)
+		{
+			/* transparent huge pages are not available - try the reserved huge page pool instead */
+			p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED)
+			{
+				munmap(pAligned, size);
+				pAligned = p;
+				*pIsHuge = 1;
+			}
+		}
+#endif
+	}
+	return pAligned;
+}
+
+/* log2 of the superblock size for a size class - see MIN_BLOCKS_PER_SUPERBLOCK */
+static unsigned int	getSpanOrder(unsigned int sizeClass)
+{
+	unsigned int	spanOrder = s_config.minSpanOrder;
+
+	while (spanOrder < REGION_ORDER &&
+			((size_t)1 << spanOrder) < s_config.minBlocksPerSuperblock * (((size_t)1 << sizeClass) + sizeof(tBlockHeader)))
+	{
+		spanOrder++;
+	}
+	return spanOrder;
+}
+
+/* Take the next unused superblocks of a span from the node's current region, mapping new regions as they are used up. Returns how many were carved -
+fewer than asked for only if the OS is out of memory. The whole batch is carved under one hold of the region mutex */
+static unsigned int	carveSuperblocks(unsigned int node, unsigned int spanOrder, tSuperblock **ppSuperblocks, unsigned int numSuperblocks)
+{
+	tRegion		*pRegion;
+	tSuperblock	*pSuperblock;
+	unsigned int	numCarved = 0;
+
+	pthread_mutex_lock(&s_hoard.regionMutex);
+
+	while (numCarved < numSuperblocks)
+	{
+		pRegion = s_hoard.pCarveRegions[node][spanOrder - MIN_SPAN_ORDER];
+		if (!pRegion || pRegion->numCarved == pRegion->numSuperblocks)
+		{
+			if (s_hoard.numRegions == MAX_REGIONS)
+			{
+				break;
+			}
+			pRegion = createRegion(node);
+			if (!pRegion)
+			{
+				break;
+			}
+			pRegion->pNext = s_hoard.pRegions;
+			s_hoard.pRegions = pRegion;
+			s_hoard.pCarveRegions[node][spanOrder - MIN_SPAN_ORDER] = pRegion;
+			pRegion->spanOrder = spanOrder;
+			pRegion->numSuperblocks = REGION_SIZE >> spanOrder;
+			pRegion->index = s_hoard.numRegions;
+			s_hoard.pRegionTable[s_hoard.numRegions++] = pRegion;
+		}
+
+		/* carve sequentially so the used part of a huge page stays dense */
+		pSuperblock = &pRegion->superblocks[pRegion->numCarved];
+		pSuperblock->pBlockArray = (tBlockHeader *)(pRegion->pBase + ((size_t)pRegion->numCarved << spanOrder));
+		pSuperblock->pRegion = pRegion;
+		pSuperblock->spanOrder = spanOrder;
+		pSuperblock->index = pRegion->index * SUPERBLOCKS_PER_REGION + pRegion->numCarved + 1;
+		pthread_mutex_init(&pSuperblock->mutex, NULL);
+		pRegion->numCarved++;
+		ppSuperblocks[numCarved++] = pSuperblock;
+	}
+
+	pthread_mutex_unlock(&s_hoard.regionMutex);
+	return numCarved;
+}
+
+/* A completely empty superblock was pushed on the global heap's empty pool. Once every superblock of its region is idle
+the whole region (one huge page in huge page mode) goes back to the OS. Never purge part of a huge page -
+that would split it into small pages */
+static void		markSuperblockIdle(tSuperblock *pSuperblock)
+{
+	tRegion		*pRegion = pSuperblock->pRegion;
+
+	pthread_mutex_lock(&s_hoard.regionMutex);
+	pRegion->numIdle++;
+	pSuperblock->isIdle = 1;
+	pSuperblock->idleSince = s_hoard.maintenanceTicks;
+	/* with a maintenance thread, purging is its job */
+	if (pRegion->numIdle == pRegion->numSuperblocks && !pRegion->isPurged && !s_config.maintenanceMs)
+	{
+		/* the region keeps its address range. Pages fault back in zeroed, and initSuperblock rewrites every header on reuse */
+		purgeRegion(pRegion);
+		DBG_MSG("purged region 0x%X\n", (unsigned int)pRegion->pBase);
+	}
+	pthread_mutex_unlock(&s_hoard.regionMutex);
+}
+
+/* An idle superblock was popped off the global heap's empty pool to be used again. The region mutex orders this after
+any purge in progress, so the memory is only touched once the purge is done. A purged superblock faults back in as soon as
+it is used, so it counts against the budget like new memory. Returns 0 if that would go over the hard limit - it stays idle then */
+static int		markSuperblockBusy(tSuperblock *pSuperblock)
+{
+	tRegion		*pRegion = pSuperblock->pRegion;
+
+	pthread_mutex_lock(&s_hoard.regionMutex);
+	if (pSuperblock->isPurged && !chargeFootprint((size_t)1 << pSuperblock->spanOrder, 1))
+	{
+		pthread_mutex_unlock(&s_hoard.regionMutex);
+		return 0;
+	}
+	pRegion->numIdle--;
+	pRegion->isPurged = 0;
+	pSuperblock->isIdle = 0;
+	if (pSuperblock->isPurged)
+	{
+		pSuperblock->isPurged = 0;
+		pRegion->purgedBytes -= (size_t)1 << pSuperblock->spanOrder;
+	}
+	pthread_mutex_unlock(&s_hoard.regionMutex);
+	return 1;
+}
+
+static tSuperblock *	popEmptySuperblock(unsigned int node, unsigned int spanOrder)
+{
+	tSuperblock		*pSuperblock;
+
+	pSuperblock = popGlobalSuperblock(&s_hoard.emptyStacks[node][spanOrder - MIN_SPAN_ORDER]);
+	if (pSuperblock && !markSuperblockBusy(pSuperblock))
+	{
+		/* over budget - a new region would be too, so the caller fails */
+		pushGlobalSuperblock(&s_hoard.emptyStacks[node][spanOrder - MIN_SPAN_ORDER], pSuperblock);
+		return 0;
+	}
+	return pSuperblock;
+}
+
+/* Every superblock of the region is idle. Purging the region purges each of them - so reusing one counts it back in the footprint */
+static int			purgeRegion(tRegion *pRegion)
+{
+	unsigned int	i;
+
+	if (madvise(pRegion->pBase, REGION_SIZE, MADV_DONTNEED))
+	{
+		return 0;
+	}
+	pRegion->isPurged = 1;
+	for (i = 0; i < pRegion->numCarved; i++)
+	{
+		pRegion->superblocks[i].isPurged = 1;
+	}
+	creditFootprint(REGION_SIZE - pRegion->purgedBytes);
+	pRegion->purgedBytes = REGION_SIZE;
+	return 1;
+}
+
+/* Initialize the superblock for a given size class and heap */
+static void initSuperblock(unsigned int heapNum, unsigned int sizeClass, tSuperblock *pSuperblock)
+{
+
+	void			*pNewBlock;				/* first block in superblock */
+	void			*pLastBlock = 0;		/* last block that fits entirely in the superblock */
+	void			*pEndOfSuperblock;		/* end of last block in superblock */
+	size_t			blockSize, blockSizeWithHeader;	/* user memory chunk + header */
+	unsigned int	numBlocks = 0;			/* final count depends on block size */
+	
+	DBG_ENTRY
+	pNewBlock			= (void*) (pSuperblock -> pBlockArray);
+	/* The actual block size is a power of two */
+	blockSize = 1 << sizeClass;
+	pEndOfSuperblock	= pNewBlock + ((size_t)1 << pSuperblock->spanOrder);
+	blockSizeWithHeader = blockSize + sizeof(tBlockHeader);
+	
+	DBG_MSG("1st block 0x%X end 0x%X blockSize %d blockSizeWithHeader %d\n",
+			(unsigned int)pNewBlock, (unsigned int)pEndOfSuperblock, blockSize, blockSizeWithHeader);
+			
+	/* fit in as many blocks as possible into the superblock */
+	while (pNewBlock + blockSizeWithHeader <= pEndOfSuperblock)
+	{
+		/* init each block */
+		((tBlockHeader *)pNewBlock) -> inUse = 0U;
+		((tBlockHeader *)pNewBlock) -> size = blockSize;
+		((tBlockHeader *)pNewBlock) -> pMySuperblock = pSuperblock;
+		((tBlockHeader *)pNewBlock) -> pNextFree = pNewBlock + blockSizeWithHeader;
+		/* advance to next block */
+		pLastBlock = pNewBlock;
+		pNewBlock += blockSizeWithHeader;
+		numBlocks++;
+	}
+
+	/* set the last block as the tail. Not the slot after it - that one doesn't fit and may lie past the end of the superblock */
+	((tBlockHeader *)pLastBlock) -> pNextFree = 0;
+	
+	DBG_MSG("numBlocks in superblock with class size %d:  %d\n",blockSize, numBlocks);
+	
+	/* init the superblock */
+	pSuperblock->pPrev = 0;
+	pSuperblock->pNext = 0;						
+	pSuperblock->sizeClass = sizeClass;
+	pSuperblock->blockSize = blockSize;
+	pSuperblock->ownerHeap = heapNum;
+	pSuperblock->numBlocks = numBlocks;
+	pSuperblock->numFreeBlocks = numBlocks;	
+	pSuperblock->pFreeBlocksHead = pSuperblock->pBlockArray;
+	
+	/* now update how much memory is held. Note that this is not the real amount of memory - but
+	rather the amount of memory held that will be taken in to account when calculating how 'empty' a superblock is */
+	updateMemoryHeld(heapNum, (pSuperblock->numBlocks * pSuperblock->blockSize));
+	
+	DBG_EXIT
+}
+
+
+static void * allocMem(unsigned int heapNum, unsigned int sizeClass)
+{
+	void 			*p;
+	tSuperblock		*pSuperblock;
+	unsigned int	batch, numRefilled, node = s_hoard.heapNodes[heapNum];
+	DBG_ENTRY
+	s_hoard.heapArray[heapNum].numMallocs++;
+	s_hoard.heapArray[heapNum].sizeClasses[sizeClass].numAllocatedSinceRefill++;
+
+	/* Is there a free block in this heap (in the appropriate size class) */
+	p = allocFromFreeBlockInHeap(heapNum, sizeClass, sizeClass);
+	if (p)
+	{
+		DBG_EXIT
+		return p;
+	}
+	
+	/* So check to see if we can use a recycled superblock */
+	p = allocFromFreeBlockInHeap(heapNum, RECYCLED_CLASS, sizeClass);
+	if (p)
+	{
+		DBG_EXIT
+		return p;
+	}
+	
+	/* The heap ran dry. Refill it with a batch of superblocks, so a thread that is ramping up doesn't come straight back here */
+	batch = getRefillBatch(heapNum, sizeClass);
+	numRefilled = 0;
+
+	/* Try the global heap of our node first - superblocks of this size class, or else completely empty ones. No global lock needed */	
+	while (numRefilled < batch &&
+			((pSuperblock = popGlobalSuperblock(&s_hoard.globalStacks[node][sizeClass])) ||
+			(pSuperblock = popEmptySuperblock(node, s_hoard.spanOrders[sizeClass]))))
+	{
+		/* move superblock to appropriate size class in regular heap */
+		moveSuperblockFromGlobal(heapNum, pSuperblock);
+		numRefilled++;
+		
+		if (!p)
+		{
+			p = allocBlock(pSuperblock, sizeClass);
+			if (p)
+			{
+				updateMemoryUsed(heapNum, pSuperblock->blockSize);
+				/* a recycled superblock has just moved to the requested size class */
+				reorderSuperblockInClass(heapNum, pSuperblock->sizeClass, pSuperblock);
+			}
+		}
+		/* a superblock of our class that is completely full - keep it and look for another */
+	}
+	
+	/* Make up the rest of the batch with new superblocks from the OS region - at least one if we still have no block */
+	if (numRefilled < batch || !p)
+	{
+		pSuperblock = addNewSuperblocks(heapNum, sizeClass, numRefilled < batch ? batch - numRefilled : 1);
+		if (pSuperblock && !p)
+		{
+			p = allocBlock(pSuperblock, sizeClass);
+			if (p)
+			{
+				updateMemoryUsed(heapNum, pSuperblock->blockSize);
+				reorderSuperblockInClass(heapNum, sizeClass, pSuperblock);
+			}
+		}
+	}
+
+	/* Our node is out of memory, or the budget is. Only now take memory of another node - every access to it is remote */
+	while (!p && s_hoard.numNodes > 1 && (pSuperblock = popRemoteSuperblock(node, sizeClass)))
+	{
+		moveSuperblockFromGlobal(heapNum, pSuperblock);
+		p = allocBlock(pSuperblock, sizeClass);
+		if (p)
+		{
+			updateMemoryUsed(heapNum, pSuperblock->blockSize);
+			reorderSuperblockInClass(heapNum, pSuperblock->sizeClass, pSuperblock);
+		}
+	}
+		
+	/* whether we failed or succeeded, return pointer - will either be NULL or point to allocated block */
+	DBG_EXIT
+	return p;
+	
+}
+
+
+/* The first block goes through allocMem, which finds a superblock or refills the heap. The rest of the batch comes straight off the
+free list of that superblock, under one class lock, until it runs dry - then allocMem finds the next one */
+static unsigned int	allocMemBatch(unsigned int heapNum, unsigned int sizeClass, tBlockHeader **ppBlocks, unsigned int count)
+{
+	tSuperblock		*pSuperblock;
+	unsigned int	num = 0, numPopped;
+	void			*p;
+
+	while (num < count)
+	{
+		p = allocMem(heapNum, sizeClass);
+		if (!p)
+		{
+			break;
+		}
+		ppBlocks[num] = (tBlockHeader *)(p - sizeof(tBlockHeader));
+		pSuperblock = ppBlocks[num++]->pMySuperblock;
+		if (num == count)
+		{
+			break;
+		}
+
+		/* the heap lock keeps the superblock in this heap and size class */
+		lockClass(heapNum, sizeClass);
+		numPopped = allocBlocks(pSuperblock, &ppBlocks[num], count - num);
+		if (numPopped)
+		{
+			num += numPopped;
+			s_hoard.heapArray[heapNum].numMallocs += numPopped;
+			s_hoard.heapArray[heapNum].sizeClasses[sizeClass].numAllocatedSinceRefill += numPopped;
+			updateMemoryUsed(heapNum, numPopped * pSuperblock->blockSize);
+			reorderSuperblockInClass(heapNum, sizeClass, pSuperblock);
+		}
+		unlockClass(heapNum, sizeClass);
+	}
+	return num;
+}
 
-/* search for free block in given size class, return pointer to block if found, otherwise NULL. Update heap statistics */
-static void * allocFromFreeBlockInHeap(unsigned int heapNum, unsigned int sizeClass)
+/* search for free block in the given list of superblocks (a size class or the recycled class) for a block of the requested size class.
+return pointer to block if found, otherwise NULL. Update heap statistics */
+static void * allocFromFreeBlockInHeap(unsigned int heapNum, unsigned int listClass, unsigned int sizeClass)
 {
 	tSizeClass		*pSizeClass;
 	tSuperblock		*pSuperblock;
@@ -657,28 +3754,37 @@ static void * allocFromFreeBlockInHeap(unsigned int heapNum, unsigned int sizeCl
 	
 	DBG_ENTRY
 	
-	/* first lock the heap */
-	lockHeap(heapNum);
-	lockClass(heapNum, sizeClass);
+	/* the heap is already locked by the caller */
+	lockClass(heapNum, listClass);
 	
 	/* Check each superblock of this heap and size class and see if it has any free memory */
-	pSizeClass = &s_hoard.heapArray[heapNum].sizeClasses[sizeClass];
-	/* start searching from the most full */
-	pSuperblock = pSizeClass->pHead;
+	pSizeClass = &s_hoard.heapArray[heapNum].sizeClasses[listClass];
+	/* start searching from the most full one that isn't full - the full ones are all in front of it */
+	pSuperblock = pSizeClass->pFirstWithFree;
 	
 	while (pSuperblock)
 	{
+		if (pSuperblock->pNext)
+		{
+			PREFETCH_FOR_WRITE(pSuperblock->pNext);
+		}
+		/* a completely empty superblock can only be recycled into a class of its own span */
+		if (RECYCLED_CLASS == listClass && pSuperblock->spanOrder != s_hoard.spanOrders[sizeClass])
+		{
+			pSuperblock = pSuperblock->pNext;
+			continue;
+		}
 		p = allocBlock(pSuperblock, sizeClass);
 		if (p)
 		{
 			/* found a free block! */
 			updateMemoryUsed(pSuperblock->ownerHeap, pSuperblock->blockSize);
 	
-			/* This block's superblock might need to change its place in the ordered list */
-			reorderSuperblockInClass(pSuperblock->ownerHeap, sizeClass, pSuperblock);
+			/* This block's superblock might need to change its place in the ordered list.
+			Note a recycled superblock has just moved to the requested size class */
+			reorderSuperblockInClass(pSuperblock->ownerHeap, pSuperblock->sizeClass, pSuperblock);
 			
-			unlockClass(heapNum, sizeClass);
-			unlockHeap(heapNum);
+			unlockClass(heapNum, listClass);
 			DBG_EXIT
 			return p;
 		}
@@ -686,195 +3792,674 @@ static void * allocFromFreeBlockInHeap(unsigned int heapNum, unsigned int sizeCl
 	}
 	
 	/* unlock everything */
-	unlockClass(heapNum, sizeClass);
-	unlockHeap(heapNum);
+	unlockClass(heapNum, listClass);
 	
 	/* No free memory found in this class */
 	DBG_EXIT
 	return 0;
 }
 
-/* create a new superblock, add to the given heap and size class, check emptiness invariant, update heap statistics, return pointer to requested block of memory */
-static void *allocFromFreeBlockInNewSuperblock(unsigned int heapNum, unsigned int sizeClass)
+/* how many superblocks to refill a heap's size class with. The first refill of a class takes one superblock, so classes that
+are hardly used don't hold more. After that the batch follows how many blocks were allocated from the class since its last refill,
+measured against what that refill brought in: about that many means the thread used it all up and will be back soon.
+Much less means the heap gave the superblocks away before using them - more of them would only go the same way */
+static unsigned int getRefillBatch(unsigned int heapNum, unsigned int sizeClass)
 {
-	tSuperblock		*pNewSuperblock;
-	void			*p;
+	tSizeClass		*pSizeClass = &s_hoard.heapArray[heapNum].sizeClasses[sizeClass];
+	size_t			lastRefill;
+	unsigned int	batch = pSizeClass->refillBatch;
+
+	if (!batch)
+	{
+		batch = 1;
+	}
+	else
+	{
+		lastRefill = batch * (((size_t)1 << s_hoard.spanOrders[sizeClass]) / (((size_t)1 << sizeClass) + sizeof(tBlockHeader)));
+		if (pSizeClass->numAllocatedSinceRefill < lastRefill / 2)
+		{
+			batch = (batch + 1) / 2;
+		}
+		else if (pSizeClass->numAllocatedSinceRefill < REFILL_GROW_RATIO * lastRefill && batch < MAX_REFILL_BATCH)
+		{
+			batch *= 2;
+		}
+		else if (pSizeClass->numAllocatedSinceRefill > REFILL_SHRINK_RATIO * lastRefill && batch > 1)
+		{
+			batch /= 2;
+		}
+	}
+	DBG_MSG("refill heap %d class %d: %d superblocks\n", heapNum, sizeClass, batch);
+
+	pSizeClass->refillBatch = batch;
+	pSizeClass->numAllocatedSinceRefill = 0;
+	return batch;
+}
+
+/* create new superblocks, add them to the given heap and size class, update heap statistics. Returns the first one, NULL if none could be created.
+The emptiness invariant is not checked here - the new superblocks are about to be used, and the next free checks it anyway */
+static tSuperblock *addNewSuperblocks(unsigned int heapNum, unsigned int sizeClass, unsigned int numSuperblocks)
+{
+	tSuperblock		*pNewSuperblocks[MAX_REFILL_BATCH];
+	unsigned int	numCreated, i;
 		
 	DBG_ENTRY
 	
-	/* first lock the heap */
-	lockHeap(heapNum);
+	/* the heap is already locked by the caller */
 	lockClass(heapNum, sizeClass);
 	
-	pNewSuperblock = createSuperblock(heapNum, sizeClass);
-	if (!pNewSuperblock)
+	numCreated = createSuperblocks(heapNum, sizeClass, pNewSuperblocks, numSuperblocks);
+	
+	/* Now attach the new superblocks to the correct size class */
+	for (i = 0; i < numCreated; i++)
+	{
+		addSuperblockToClass(heapNum, sizeClass, pNewSuperblocks[i]);
+	}
+	
+	unlockClass(heapNum, sizeClass);
+	
+	DBG_EXIT
+	return numCreated ? pNewSuperblocks[0] : 0;
+}
+
+/* memory to add to 'memory held' statistic in given heap. Memory to add may be negative. */
+static void updateMemoryHeld(unsigned int heapNum, int memoryToAdd)
+{
+	if (GLOBAL_HEAP == heapNum)
+	{
+		/* the global heap has no lock */
+		__atomic_add_fetch(&s_hoard.heapArray[heapNum].statMemoryHeld, memoryToAdd, __ATOMIC_RELAXED);
+		return;
+	}
+	s_hoard.heapArray[heapNum].statMemoryHeld += memoryToAdd;
+}
+
+/* memory to add to 'memory used' statistic in given heap. Memory to add may be negative. */
+static void updateMemoryUsed(unsigned int heapNum, int memoryToAdd)
+{
+	if (GLOBAL_HEAP == heapNum)
+	{
+		__atomic_add_fetch(&s_hoard.heapArray[heapNum].statMemoryInUse, memoryToAdd, __ATOMIC_RELAXED);
+		return;
+	}
+	s_hoard.heapArray[heapNum].statMemoryInUse += memoryToAdd;
+}
+
+
+/* return 1 if heap is under the fullness threshold, otherwise if heap is still full enough, return 0 */
+static int isEmptyEnough(unsigned int heapNum)
+{
+	size_t	memHeld, memInUse;
+	
+	memHeld = s_hoard.heapArray[heapNum].statMemoryHeld;
+	memInUse = s_hoard.heapArray[heapNum].statMemoryInUse;
+	
+	/* u(i) < a(i) - K*S, written so that it can't underflow */
+	if (memInUse + (size_t)s_hoard.heapArray[heapNum].emptyThresholdK * SUPERBLOCK_SIZE >= memHeld)
+	{
+		return 0;
+	}
+	
+	if (memInUse >= (1 - s_hoard.heapArray[heapNum].fullnessF) * memHeld)
+	{
+		return 0;
+	}
+	/* The emptiness invariant holds */	
+	return 1;
+}
+
+/* return the superblock that is empty enough to be moved to the global heap */
+static tSuperblock *findEmptyEnoughSuperblock(unsigned int heapNum)
+{
+	int				sizeClassIdx;
+	tSizeClass		*pSizeClass;
+	tHeap			*pHeap;
+	tSuperblock		*pSuperblock;
+	
+	DBG_ENTRY
+	/* search through this heap's size classes for a superblock that maintains the emptiness invariant 
+	'at least f empty'  - this is using a slow algorithm .. another point that can be optimized */
+	pHeap = &s_hoard.heapArray[heapNum];
+	
+	for (sizeClassIdx = 0; sizeClassIdx < NUM_SIZE_CLASSES; sizeClassIdx++)
+	{
+		pSizeClass = &pHeap->sizeClasses[sizeClassIdx];
+		/* just check the tail since the list is ordered from full to least full */
+		pSuperblock = pSizeClass->pTail;
+		//DBG_MSG("sizeClassIdx=%d pSuperblock=0x%x\n",sizeClassIdx, (unsigned int)pSuperblock);
+		if (pSuperblock && ((double)pSuperblock->numFreeBlocks / pSuperblock->numBlocks > pHeap->fullnessF))
+		{
+			DBG_EXIT
+			return pSuperblock;
+		}
+	}
+	DBG_EXIT
+	return 0;	
+}
+
+/* give a superblock of the given heap to the global heap, update statistics. The caller holds the heap lock */
+static void moveSuperblockToGlobal(unsigned int heapNum, tSuperblock *pSuperblock)
+{
+	unsigned int	sizeClass, numBlocks;
+	size_t			heldMemorySize, usedMemorySize, blockSize;
+
+	DBG_ENTRY
+	
+	/* stay in same size class */
+	sizeClass = pSuperblock->sizeClass;
+	removeSuperblockFromClass(heapNum, sizeClass, pSuperblock);
+	
+	/* from here on frees to this superblock go through the superblock lock instead of the heap lock */
+	pthread_mutex_lock(&pSuperblock->mutex);
+	
+	numBlocks = pSuperblock->numBlocks;
+	blockSize = pSuperblock->blockSize;
+	heldMemorySize = numBlocks * blockSize;
+	usedMemorySize = (numBlocks - pSuperblock->numFreeBlocks)*blockSize;
+	
+	updateMemoryHeld(heapNum, (-1)*heldMemorySize);
+	updateMemoryUsed(heapNum, (-1)*usedMemorySize);
+	updateMemoryHeld(GLOBAL_HEAP, heldMemorySize);
+	updateMemoryUsed(GLOBAL_HEAP, usedMemorySize);
+	
+	pSuperblock->ownerHeap = GLOBAL_HEAP;
+	
+	pthread_mutex_unlock(&pSuperblock->mutex);
+	
+	s_hoard.heapArray[heapNum].numToGlobal++;
+	__atomic_add_fetch(&s_hoard.heapArray[GLOBAL_HEAP].numToGlobal, 1, __ATOMIC_RELAXED);
+	
+	if (RECYCLED_CLASS == sizeClass)
+	{
+		/* completely empty superblock parked in the global heap - its region may be purged.
+		Count it before it can be popped, so a purge never hits a superblock that is back in use */
+		markSuperblockIdle(pSuperblock);
+		pushGlobalSuperblock(getEmptyStack(pSuperblock), pSuperblock);
+	}
+	else
+	{
+		pushGlobalSuperblock(getGlobalStack(pSuperblock, sizeClass), pSuperblock);
+	}
+	DBG_EXIT
+}
+
+/* take a superblock popped off a global heap stack into the given heap, update statistics. The caller holds the heap lock */
+static void moveSuperblockFromGlobal(unsigned int heapNum, tSuperblock *pSuperblock)
+{
+	unsigned int	numBlocks;
+	size_t			heldMemorySize, usedMemorySize, blockSize;
+
+	DBG_ENTRY
+	
+	/* wait for a free that may be working on the superblock. Once we are the owner, frees need our heap lock */
+	pthread_mutex_lock(&pSuperblock->mutex);
+	
+	numBlocks = pSuperblock->numBlocks;
+	blockSize = pSuperblock->blockSize;
+	heldMemorySize = numBlocks * blockSize;
+	usedMemorySize = (numBlocks - pSuperblock->numFreeBlocks)*blockSize;
+	
+	updateMemoryHeld(GLOBAL_HEAP, (-1)*heldMemorySize);
+	updateMemoryUsed(GLOBAL_HEAP, (-1)*usedMemorySize);
+	updateMemoryHeld(heapNum, heldMemorySize);
+	updateMemoryUsed(heapNum, usedMemorySize);
+	
+	pSuperblock->ownerHeap = heapNum;
+	
+	pthread_mutex_unlock(&pSuperblock->mutex);
+	
+	s_hoard.heapArray[heapNum].numFromGlobal++;
+	__atomic_add_fetch(&s_hoard.heapArray[GLOBAL_HEAP].numFromGlobal, 1, __ATOMIC_RELAXED);
+	addSuperblockToClass(heapNum, pSuperblock->sizeClass, pSuperblock);
+	DBG_EXIT
+}
+
+/* A superblock for an arena or an object cache. It leaves the heaps altogether - its memory counts in no heap's statistics while the arena has it */
+static tSuperblock *	takeEmptySuperblock(unsigned int node, unsigned int spanOrder)
+{
+	tSuperblock		*pSuperblock = 0;
+	unsigned int	heapNum, remote, isPooled;
+
+	/* a completely empty superblock the calling thread's heap holds anyway */
+	if (getHeapNumber(&heapNum))
+	{
+		lockHeap(heapNum);
+		lockClass(heapNum, RECYCLED_CLASS);
+		for (pSuperblock = s_hoard.heapArray[heapNum].sizeClasses[RECYCLED_CLASS].pHead;
+			pSuperblock && (pSuperblock->spanOrder != spanOrder || pSuperblock->pRegion->node != node);
+			pSuperblock = pSuperblock->pNext);
+		if (pSuperblock)
+		{
+			removeSuperblockFromClass(heapNum, RECYCLED_CLASS, pSuperblock);
+			updateMemoryHeld(heapNum, (-1)*(pSuperblock->numBlocks * pSuperblock->blockSize));
+		}
+		unlockClass(heapNum, RECYCLED_CLASS);
+		unlockHeap(heapNum);
+	}
+
+	/* else one from the empty pool of the node's global heap, else a new one - and as a last resort an empty one of another node */
+	if (!pSuperblock)
+	{
+		isPooled = 1;
+		pSuperblock = popEmptySuperblock(node, spanOrder);
+		if (!pSuperblock && carveSuperblocks(node, spanOrder, &pSuperblock, 1))
+		{
+			isPooled = 0;
+		}
+		for (remote = (node + 1) % s_hoard.numNodes; !pSuperblock && remote != node; remote = (remote + 1) % s_hoard.numNodes)
+		{
+			pSuperblock = popEmptySuperblock(remote, spanOrder);
+		}
+		if (!pSuperblock)
+		{
+			return 0;
+		}
+		if (isPooled)
+		{
+			/* wait for a free that may still be working on it */
+			pthread_mutex_lock(&pSuperblock->mutex);
+			updateMemoryHeld(GLOBAL_HEAP, (-1)*(pSuperblock->numBlocks * pSuperblock->blockSize));
+			pthread_mutex_unlock(&pSuperblock->mutex);
+		}
+	}
+	pSuperblock->ownerHeap = GLOBAL_HEAP;
+	pSuperblock->sizeClass = LENT_CLASS;
+	pSuperblock->pPrev = NULL;
+	pSuperblock->pNext = NULL;
+	return pSuperblock;
+}
+
+/* The arena wrote over the block headers, so the superblock goes back as a single free block of size 0 - completely empty, holding
+nothing in the global heap's statistics. Whoever takes it recycles it into a size class before the first allocation */
+static void			releaseArenaSuperblock(tSuperblock *pSuperblock)
+{
+	pSuperblock->ownerHeap = GLOBAL_HEAP;
+	pSuperblock->sizeClass = RECYCLED_CLASS;
+	pSuperblock->blockSize = 0;
+	pSuperblock->numBlocks = 1;
+	pSuperblock->numFreeBlocks = 1;
+	pSuperblock->pFreeBlocksHead = NULL;
+	markSuperblockIdle(pSuperblock);
+	pushGlobalSuperblock(getEmptyStack(pSuperblock), pSuperblock);
+}
+
+/* Empty superblocks made ready for a size class ahead of the first malloc: faulted in, with the blocks laid out. They are spread over
+the nodes and the heaps of each node round robin, as long as a heap's emptiness invariant lets it keep them - with the default K of 0
+none can. The rest wait in the stack of the class of their node's global heap, where a heap that runs dry finds them before it carves
+anything new. Reused empty superblocks are taken first, like for an arena */
+static int			reserveSuperblocks(unsigned int sizeClass, size_t count)
+{
+	static unsigned int	nextHeap[MAX_NODES];
+	tSuperblock		*pSuperblock;
+	unsigned int	spanOrder = s_hoard.spanOrders[sizeClass];
+	size_t			blocksPerSuperblock, numSuperblocks;
+	unsigned int	heapNum, node = 0, numFullHeaps[MAX_NODES] = { 0 };
+
+	blocksPerSuperblock = ((size_t)1 << spanOrder) / (((size_t)1 << sizeClass) + sizeof(tBlockHeader));
+	for (numSuperblocks = (count + blocksPerSuperblock - 1) / blocksPerSuperblock; numSuperblocks; numSuperblocks--)
+	{
+		node = (node + 1) % s_hoard.numNodes;
+		pSuperblock = takeEmptySuperblock(node, spanOrder);
+		if (!pSuperblock)
+		{
+			return 0;
+		}
+		prefaultMemory(pSuperblock->pBlockArray, (size_t)1 << spanOrder);
+
+		/* the global heap is never picked - once every heap of the node said no, the rest go straight to the global heap */
+		while (numFullHeaps[node] < s_hoard.numNodeHeaps[node])
+		{
+			heapNum = s_hoard.firstNodeHeap[node] + __atomic_fetch_add(&nextHeap[node], 1, __ATOMIC_RELAXED) % s_hoard.numNodeHeaps[node];
+			lockHeap(heapNum);
+			lockClass(heapNum, sizeClass);
+			initSuperblock(heapNum, sizeClass, pSuperblock);
+			if (!isEmptyEnough(heapNum))
+			{
+				addSuperblockToClass(heapNum, sizeClass, pSuperblock);
+				unlockClass(heapNum, sizeClass);
+				unlockHeap(heapNum);
+				break;
+			}
+			/* the heap would hand it straight to the global heap on its next free */
+			updateMemoryHeld(heapNum, (-1)*(pSuperblock->numBlocks * pSuperblock->blockSize));
+			unlockClass(heapNum, sizeClass);
+			unlockHeap(heapNum);
+			numFullHeaps[node]++;
+		}
+		if (numFullHeaps[node] == s_hoard.numNodeHeaps[node])
+		{
+			initSuperblock(GLOBAL_HEAP, sizeClass, pSuperblock);
+			pushGlobalSuperblock(getGlobalStack(pSuperblock, sizeClass), pSuperblock);
+		}
+	}
+	return 1;
+}
+
+/* Add to the footprint. Crossing the soft limit only raises underPressure - whoever charges may hold any lock, so the relief
+comes later from the top of malloc or the maintenance thread. The hard limit refuses new memory, and tells the thread why its
+allocation is about to fail */
+static int			chargeFootprint(size_t size, int mayFail)
+{
+	size_t			footprint, hardLimit, softLimit;
+
+	footprint = __atomic_add_fetch(&s_hoard.footprint, size, __ATOMIC_RELAXED);
+	hardLimit = __atomic_load_n(&s_config.hardLimit, __ATOMIC_RELAXED);
+	if (mayFail && hardLimit && footprint > hardLimit)
+	{
+		__atomic_sub_fetch(&s_hoard.footprint, size, __ATOMIC_RELAXED);
+		t_overBudget = 1;
+		return 0;
+	}
+	softLimit = __atomic_load_n(&s_config.softLimit, __ATOMIC_RELAXED);
+	if (softLimit && footprint > softLimit && footprint >= __atomic_load_n(&s_hoard.pressureMark, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&s_hoard.underPressure, 1, __ATOMIC_RELAXED);
+	}
+	return 1;
+}
+
+static void			creditFootprint(size_t size)
+{
+	__atomic_sub_fetch(&s_hoard.footprint, size, __ATOMIC_RELAXED);
+}
+
+/* Give the process a chance to shed its own caches first, then drop every heap's K and f back to the configured values - the least
+memory they hold on to - and trim. Runs when the footprint crosses the soft limit, and again for every PRESSURE_RELIEF_STEP it grows
+past it - a trim walks every heap, so not for every superblock. adaptEmptinessThreshold doesn't raise K and f while it stays over */
+static void			relievePressure(void)
+{
+	void			(*pCallback)(int, size_t);
+	unsigned int	heap;
+	size_t			footprint;
+
+	if (!__atomic_exchange_n(&s_hoard.underPressure, 0, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	pCallback = __atomic_load_n(&s_hoard.pPressureCallback, __ATOMIC_ACQUIRE);
+	if (pCallback)
+	{
+		pCallback(MTMM_PRESSURE_SOFT, __atomic_load_n(&s_hoard.footprint, __ATOMIC_RELAXED));
+	}
+	for (heap = 1; heap < s_config.numHeaps; heap++)
+	{
+		lockHeap(heap);
+		s_hoard.heapArray[heap].emptyThresholdK = s_config.emptyThresholdK;
+		s_hoard.heapArray[heap].fullnessF = s_config.fullnessF;
+		unlockHeap(heap);
+	}
+	trimHeaps();
+	footprint = __atomic_load_n(&s_hoard.footprint, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_hoard.pressureMark,
+					footprint > __atomic_load_n(&s_config.softLimit, __ATOMIC_RELAXED) ? footprint + PRESSURE_RELIEF_STEP : 0, __ATOMIC_RELAXED);
+}
+
+/* The allocation failed with every lock released. If the hard limit was the reason, let the callback free what it can and trim -
+the memory they give back makes room for one more try. t_budgetRetry stays set until the caller has made that try, so neither
+the retry nor an allocation inside the callback comes back here */
+static int			retryOverBudget(void)
+{
+	void			(*pCallback)(int, size_t);
+
+	if (!t_overBudget)
+	{
+		return 0;
+	}
+	t_overBudget = 0;
+	errno = ENOMEM;
+	if (t_budgetRetry)
+	{
+		return 0;
+	}
+	t_budgetRetry = 1;
+	pCallback = __atomic_load_n(&s_hoard.pPressureCallback, __ATOMIC_ACQUIRE);
+	if (pCallback)
+	{
+		pCallback(MTMM_PRESSURE_HARD, __atomic_load_n(&s_hoard.footprint, __ATOMIC_RELAXED));
+	}
+	trimHeaps();
+	return 1;
+}
+
+/* Write to every page of fresh memory, so the page faults happen now and not on the first mallocs. One madvise where the kernel has it */
+static void			prefaultMemory(void *p, size_t size)
+{
+	size_t			pageSize = sysconf(_SC_PAGESIZE);
+	size_t			offset;
+
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(p, size, MADV_POPULATE_WRITE))
+	{
+		return;
+	}
+#endif
+	for (offset = 0; offset < size; offset += pageSize)
+	{
+		((volatile char *)p)[offset] = 0;
+	}
+}
+
+/* The thread's magazine ran dry. Swap it for one from the depot, or else carve a new object and construct it */
+static void *		allocFromObjectCache(tMtmmCache *pCache)
+{
+	tMagazine		*pMagazine = t_pMagazines[pCache->index];
+	tSuperblock		*pSuperblock;
+	unsigned int	heapNum;
+	void			*p;
+
+	/* makes sure the thread's magazines are flushed when it exits */
+	getHeapNumber(&heapNum);
+
+	pthread_mutex_lock(&pCache->mutex);
+	if (pCache->pFullMagazines)
 	{
-		unlockClass(heapNum, sizeClass);
-		unlockHeap(heapNum);
-		DBG_EXIT
-		return 0;
+		if (pMagazine)
+		{
+			pMagazine->pNext = pCache->pEmptyMagazines;
+			pCache->pEmptyMagazines = pMagazine;
+		}
+		pMagazine = pCache->pFullMagazines;
+		pCache->pFullMagazines = pMagazine->pNext;
+		pthread_mutex_unlock(&pCache->mutex);
+		t_pMagazines[pCache->index] = pMagazine;
+		return pMagazine->pObjects[--pMagazine->numObjects];
 	}
-		
-	p = allocBlock(pNewSuperblock, sizeClass);
-	
-	if (!p)
+
+	if (pCache->pStrayObjects)
 	{
-		/* shouldn't get to this, since it's a brand new empty superblock ... maybe should assert?*/
-		unlockClass(heapNum, sizeClass);
-		unlockHeap(heapNum);
-		DBG_EXIT
-		return 0;
+		/* its link went over the object, so it is constructed again */
+		p = pCache->pStrayObjects;
+		memcpy(&pCache->pStrayObjects, p, sizeof(void *));
+		pthread_mutex_unlock(&pCache->mutex);
+		if (pCache->ctor)
+		{
+			pCache->ctor(p);
+		}
+		return p;
 	}
 
-	updateMemoryUsed(heapNum, pNewSuperblock->blockSize);
-	
-	/* Now attach the new superblock to the correct size class */
-	addSuperblockToClass(heapNum, sizeClass, pNewSuperblock);
+	if (!pCache->pNextFree || pCache->pNextFree + pCache->objSize > pCache->pEnd)
+	{
+		pSuperblock = takeEmptySuperblock(getThreadNode(), pCache->spanOrder);
+		if (!pSuperblock)
+		{
+			pthread_mutex_unlock(&pCache->mutex);
+			return 0;
+		}
+		pCache->pNextFree = (char *)pSuperblock->pBlockArray;
+		pCache->pEnd = pCache->pNextFree + ((size_t)1 << pCache->spanOrder);
+	}
+	p = pCache->pNextFree;
+	pCache->pNextFree += pCache->objSize;
+	pthread_mutex_unlock(&pCache->mutex);
 
-	/* Check heap invariants, if necessary move superblock to global heap */		
-	checkInvariantAndMoveSuperblocks(heapNum);		
-	
-	unlockClass(heapNum, sizeClass);
-	unlockHeap(heapNum);
-	
-	DBG_EXIT
+	if (pCache->ctor)
+	{
+		pCache->ctor(p);
+	}
 	return p;
 }
 
-/* memory to add to 'memory held' statistic in given heap. Memory to add may be negative. */
-static void updateMemoryHeld(unsigned int heapNum, int memoryToAdd)
+/* The thread's magazine is full. Put it in the depot and load an empty one */
+static void			freeToObjectCache(tMtmmCache *pCache, void *p)
 {
-	s_hoard.heapArray[heapNum].statMemoryHeld += memoryToAdd;
-}
+	tMagazine		*pMagazine = t_pMagazines[pCache->index];
+	tMagazine		*pEmptyMagazine;
+	unsigned int	heapNum;
 
-/* memory to add to 'memory used' statistic in given heap. Memory to add may be negative. */
-static void updateMemoryUsed(unsigned int heapNum, int memoryToAdd)
-{
-	s_hoard.heapArray[heapNum].statMemoryInUse += memoryToAdd;
-}
+	getHeapNumber(&heapNum);
 
+	pthread_mutex_lock(&pCache->mutex);
+	pEmptyMagazine = pCache->pEmptyMagazines;
+	if (pEmptyMagazine)
+	{
+		pCache->pEmptyMagazines = pEmptyMagazine->pNext;
+	}
+	pthread_mutex_unlock(&pCache->mutex);
 
-/* return 1 if heap is under the fullness threshold, otherwise if heap is still full enough, return 0 */
-static int isEmptyEnough(unsigned int heapNum)
-{
-	size_t	memHeld, memInUse;
-	
-	memHeld = s_hoard.heapArray[heapNum].statMemoryHeld;
-	memInUse = s_hoard.heapArray[heapNum].statMemoryInUse;
-	
-	/* fortunately k=0 - otherwise there would be a bug here.. because elsewhere memory in use is numblocks*blocksize... */
-	if (memInUse >= memHeld - (SUPERBLOCK_EMPTY_THRESHHOLD_K * SUPERBLOCK_SIZE))
+	if (!pEmptyMagazine)
 	{
-		return 0;
+		pEmptyMagazine = malloc(sizeof(tMagazine));
+		if (!pEmptyMagazine)
+		{
+			/* nowhere to keep it - chain it to the cache, so an allocation takes it before carving a new one */
+			DBG_MSG("no magazine for object 0x%X\n", (unsigned int)p);
+			pthread_mutex_lock(&pCache->mutex);
+			memcpy(p, &pCache->pStrayObjects, sizeof(void *));
+			pCache->pStrayObjects = p;
+			pthread_mutex_unlock(&pCache->mutex);
+			return;
+		}
+		pEmptyMagazine->numObjects = 0;
 	}
-	
-	if (memInUse >= (1 - FULLNESS_THRESHOLD_F) * memHeld)
+
+	if (pMagazine)
 	{
-		return 0;
+		pthread_mutex_lock(&pCache->mutex);
+		pMagazine->pNext = pCache->pFullMagazines;
+		pCache->pFullMagazines = pMagazine;
+		pthread_mutex_unlock(&pCache->mutex);
 	}
-	/* The emptiness invariant holds */	
-	return 1;
+	pEmptyMagazine->pObjects[pEmptyMagazine->numObjects++] = p;
+	t_pMagazines[pCache->index] = pEmptyMagazine;
 }
 
-/* return the superblock that is empty enough to be moved to the global heap */
-static tSuperblock *findEmptyEnoughSuperblock(unsigned int heapNum)
+static void			flushThreadMagazines(void)
 {
-	int				sizeClassIdx;
-	tSizeClass		*pSizeClass;
-	tHeap			*pHeap;
-	tSuperblock		*pSuperblock;
-	
-	DBG_ENTRY
-	/* search through this heap's size classes for a superblock that maintains the emptiness invariant 
-	'at least f empty'  - this is using a slow algorithm .. another point that can be optimized */
-	pHeap = &s_hoard.heapArray[heapNum];
-	
-	for (sizeClassIdx = 0; sizeClassIdx < NUM_SIZE_CLASSES; sizeClassIdx++)
+	tMagazine		*pMagazine;
+	tMtmmCache		*pCache;
+	unsigned int	index;
+
+	for (index = 0; index < MAX_OBJECT_CACHES; index++)
 	{
-		pSizeClass = &pHeap->sizeClasses[sizeClassIdx];
-		/* just check the tail since the list is ordered from full to least full */
-		pSuperblock = pSizeClass->pTail;
-		//DBG_MSG("sizeClassIdx=%d pSuperblock=0x%x\n",sizeClassIdx, (unsigned int)pSuperblock);
-		if (pSuperblock && ((pSuperblock->numFreeBlocks/pSuperblock->numBlocks) > FULLNESS_THRESHOLD_F))
+		pMagazine = t_pMagazines[index];
+		if (!pMagazine)
 		{
-			DBG_EXIT
-			return pSuperblock;
+			continue;
+		}
+		t_pMagazines[index] = NULL;
+		pCache = __atomic_load_n(&s_hoard.pObjectCaches[index], __ATOMIC_ACQUIRE);
+		pthread_mutex_lock(&pCache->mutex);
+		if (pMagazine->numObjects)
+		{
+			pMagazine->pNext = pCache->pFullMagazines;
+			pCache->pFullMagazines = pMagazine;
+		}
+		else
+		{
+			pMagazine->pNext = pCache->pEmptyMagazines;
+			pCache->pEmptyMagazines = pMagazine;
 		}
+		pthread_mutex_unlock(&pCache->mutex);
 	}
-	DBG_EXIT
-	return 0;	
 }
 
-/* move superblock from one heap to the other, update statistics ...*/
-static void moveSuperblockFromTo(unsigned int fromHeap, unsigned int toHeap, tSuperblock *pSuperblock)
+/* lock-free push on a global heap stack */
+static void			pushGlobalSuperblock(tSuperblockStack *pStack, tSuperblock *pSuperblock)
 {
-	unsigned int	sizeClass, numBlocks;
-	size_t			heldMemorySize, usedMemorySize, blockSize;
-
-	DBG_ENTRY
-	
-	lockHeap(toHeap);
-	
-	numBlocks = pSuperblock->numBlocks;
-	blockSize = pSuperblock->blockSize;
-	
-	heldMemorySize = numBlocks * blockSize;
-	usedMemorySize = (numBlocks - pSuperblock->numFreeBlocks)*blockSize;
-		
-	/* stay in same size class */
-	sizeClass = pSuperblock->sizeClass;
-	
-	removeSuperblockFromClass(fromHeap, sizeClass, pSuperblock);	
-	updateMemoryHeld(fromHeap, (-1)*heldMemorySize);
-	updateMemoryUsed(fromHeap, (-1)*usedMemorySize);
+	uint64_t		oldTop, newTop;
 	
-	lockClass(toHeap, sizeClass);
-	
-	addSuperblockToClass(toHeap, sizeClass, pSuperblock);
-	updateMemoryHeld(toHeap, heldMemorySize);
-	updateMemoryUsed(toHeap, usedMemorySize);
+	oldTop = __atomic_load_n(&pStack->top, __ATOMIC_RELAXED);
+	do
+	{
+		pSuperblock->nextInStack = (unsigned int)oldTop;
+		newTop = (((oldTop >> 32) + 1) << 32) | pSuperblock->index;
+	} while (!__atomic_compare_exchange_n(&pStack->top, &oldTop, newTop, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* lock-free pop from a global heap stack. NULL if the stack is empty */
+static tSuperblock *	popGlobalSuperblock(tSuperblockStack *pStack)
+{
+	uint64_t		oldTop, newTop;
+	tSuperblock		*pSuperblock;
 	
-	pSuperblock->ownerHeap = toHeap;
+	oldTop = __atomic_load_n(&pStack->top, __ATOMIC_ACQUIRE);
+	do
+	{
+		if (!(unsigned int)oldTop)
+		{
+			return 0;
+		}
+		/* descriptors are never unmapped, so reading nextInStack of a superblock someone else just popped is harmless.
+		The generation count makes the exchange fail in that case */
+		pSuperblock = getSuperblockByIndex((unsigned int)oldTop);
+		newTop = (((oldTop >> 32) + 1) << 32) | __atomic_load_n(&pSuperblock->nextInStack, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&pStack->top, &oldTop, newTop, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
 	
-	unlockClass(toHeap, sizeClass);
-	unlockHeap(toHeap);
+	return pSuperblock;
+}
 
+/* superblock by its index */
+static tSuperblock *	getSuperblockByIndex(unsigned int index)
+{
+	index--;
+	return &s_hoard.pRegionTable[index / SUPERBLOCKS_PER_REGION]->superblocks[index % SUPERBLOCKS_PER_REGION];
 }
 
 /* add superblock to the sorted-from-fullest-to-emptiest list of superblocks for the given size class and heap */
 static void addSuperblockToClass(unsigned int heapNum, unsigned int sizeClass, tSuperblock *pSuperblock)
 {
-	float			emptyFactor, tempEmptyFactor;
+	unsigned int	tier;
 	tSuperblock		*pTempSb;
 	tSizeClass		*pSizeClass;
 	DBG_ENTRY
 	
 	DBG_MSG("heap %d size %d pSuperblock=0x%x\n", heapNum, sizeClass, (unsigned int)pSuperblock);
 	pSizeClass = &s_hoard.heapArray[heapNum].sizeClasses[sizeClass];
-	emptyFactor = (pSuperblock->numFreeBlocks/pSuperblock->numBlocks);
+	tier = getFullnessTier(pSuperblock);
 	/* make sure the superblock to be attached isn't still chained to its previous size class linked list */
 	pSuperblock->pNext = NULL;
 	pSuperblock->pPrev = NULL;	
 	
-	/* we'll start the search from the tail because usually we're adding empty superblocks. This algo. can be improved */
-	pTempSb = pSizeClass->pTail;
 	DBG_MSG("start search from tail=0x%x\n",(unsigned int)pSizeClass->pTail);
-		
-	if (!pTempSb)
+	if (!pSizeClass->pTail)
 	{
 		/* this is the first superblock in the chain */
 		pSizeClass->pHead = pSizeClass->pTail = pSuperblock;
+		pSizeClass->pFirstWithFree = tier ? pSuperblock : 0;
 		DBG_MSG("first superblock in chain head=0x%x tail=0x%x\n", (unsigned int)pSizeClass->pHead, (unsigned int)pSizeClass->pTail);
 		DBG_EXIT
 		return;
 	}
 	
 	/* not the first - need to find its place in the order */
-	tempEmptyFactor = pTempSb->numFreeBlocks/pTempSb->numBlocks;
-	while (pTempSb && emptyFactor < tempEmptyFactor)
+	if (!tier)
+	{
+		/* a full superblock goes right after the other full ones, no search needed */
+		pTempSb = pSizeClass->pFirstWithFree ? pSizeClass->pFirstWithFree->pPrev : pSizeClass->pTail;
+	}
+	else
 	{
-		pTempSb = pTempSb->pPrev;
-		tempEmptyFactor = pTempSb->numFreeBlocks/pTempSb->numBlocks;
+		/* start the search from the tail - it only has to get past the completely empty ones */
+		pTempSb = pSizeClass->pTail;
+		while (pTempSb && tier < getFullnessTier(pTempSb))
+		{
+			pTempSb = pTempSb->pPrev;
+		}
+		if (!pTempSb || !getFullnessTier(pTempSb))
+		{
+			pSizeClass->pFirstWithFree = pSuperblock;
+		}
 	}
 	
 	if (pTempSb)
@@ -918,6 +4503,11 @@ static void removeSuperblockFromClass(unsigned int heapNum, unsigned int sizeCla
 	
 	pSizeClass = &s_hoard.heapArray[heapNum].sizeClasses[sizeClass];
 	
+	if (pSizeClass->pFirstWithFree == pSuperblock)
+	{
+		/* the superblocks after it are no fuller */
+		pSizeClass->pFirstWithFree = pSuperblock->pNext;
+	}
 	if (pSuperblock->pNext)
 	{
 		pSuperblock->pNext->pPrev = pSuperblock->pPrev;	
@@ -940,6 +4530,15 @@ static void removeSuperblockFromClass(unsigned int heapNum, unsigned int sizeCla
 	DBG_EXIT
 }
 
+static unsigned int	getFullnessTier(tSuperblock *pSuperblock)
+{
+	if (!pSuperblock->numFreeBlocks)
+	{
+		return 0;
+	}
+	return pSuperblock->numFreeBlocks == pSuperblock->numBlocks ? 2 : 1;
+}
+
 /* Keep sorted-from-fullest-to-emptiest list of superblocks sorted upon malloc or free */
 static void reorderSuperblockInClass(unsigned int heapNum, unsigned int sizeClass, tSuperblock *pSuperblock)
 {
@@ -956,6 +4555,12 @@ void * allocBlock(tSuperblock *pSuperblock, unsigned int requestedSizeClass)
 	void				*p = 0;
 	
 	DBG_ENTRY
+	if (RECYCLED_CLASS == pSuperblock->sizeClass)
+	{
+		/* carve the blocks again for the new size class. A superblock an arena gave back has no free list until then */
+		recycleSuperblock(pSuperblock->ownerHeap, requestedSizeClass, pSuperblock);
+	}
+	
 	pBlock = pSuperblock->pFreeBlocksHead;
 	
 	if (!pBlock)
@@ -964,26 +4569,53 @@ void * allocBlock(tSuperblock *pSuperblock, unsigned int requestedSizeClass)
 		return 0;
 	}
 	
-	if (RECYCLED_CLASS == pSuperblock->sizeClass)
-	{
-		recycleSuperblock(pSuperblock->ownerHeap, requestedSizeClass, pSuperblock);
-	}
-	
 	/* user memory block has a header right before it. This is the 'trick' for finding block info on free*/
 	p = ((void *)pBlock) + sizeof(tBlockHeader);
 	
-	/* unlink block from head of free chain */
+	/* unlink block from head of free chain. The next malloc from here writes the new head */
 	pSuperblock->pFreeBlocksHead = pBlock->pNextFree;
+	if (pBlock->pNextFree)
+	{
+		PREFETCH_FOR_WRITE(pBlock->pNextFree);
+	}
 	pBlock->pNextFree = NULL;
 	
 	/* update flags and free block counter*/
-	pBlock->inUse = 1;	
+	pBlock->inUse = BLOCK_IN_USE;	
 	pSuperblock->numFreeBlocks--;
+	countBlocksOut(pSuperblock->sizeClass, 1);
 	
 	DBG_EXIT
 	return p;
 }
 
+/* Like allocBlock for several blocks. The list is walked two blocks ahead: while one block is unlinked, the next is already
+being loaded and the one after it prefetched, so the misses of a cold list overlap instead of following one another */
+static unsigned int	allocBlocks(tSuperblock *pSuperblock, tBlockHeader **ppBlocks, unsigned int count)
+{
+	tBlockHeader		*pBlock, *pNext;
+	unsigned int		num = 0;
+
+	pBlock = pSuperblock->pFreeBlocksHead;
+	pNext = pBlock ? pBlock->pNextFree : 0;
+	while (pBlock && num < count)
+	{
+		if (pNext)
+		{
+			PREFETCH_FOR_WRITE(pNext->pNextFree);
+		}
+		pBlock->pNextFree = NULL;
+		pBlock->inUse = BLOCK_IN_USE;
+		ppBlocks[num++] = pBlock;
+		pBlock = pNext;
+		pNext = pBlock ? pBlock->pNextFree : 0;
+	}
+	pSuperblock->pFreeBlocksHead = pBlock;
+	pSuperblock->numFreeBlocks -= num;
+	countBlocksOut(pSuperblock->sizeClass, num);
+	return num;
+}
+
 static void recycleSuperblock(unsigned int heapNum, unsigned int newSizeClass, tSuperblock *pSuperblock)
 {	
 	DBG_ENTRY
@@ -1002,9 +4634,11 @@ static void recycleSuperblock(unsigned int heapNum, unsigned int newSizeClass, t
 		held by superblock depended on the previous size class, and on how many blocks we managed to fit
 		in to this superblock while taking the block header size into consideration.. */
 	updateMemoryHeld(heapNum, (-1)*(pSuperblock->numBlocks * pSuperblock->blockSize));
+	removeSuperblockFromClass(heapNum, RECYCLED_CLASS, pSuperblock);
 	
 	/* Now overwrite numBlocks, blockSize and heap stats */
 	initSuperblock(heapNum, newSizeClass, pSuperblock);
+	addSuperblockToClass(heapNum, newSizeClass, pSuperblock);
 		
 	DBG_EXIT
 }
@@ -1012,36 +4646,246 @@ static void recycleSuperblock(unsigned int heapNum, unsigned int newSizeClass, t
 static void checkInvariantAndMoveSuperblocks(unsigned int heapNum)
 {	
 	tSuperblock *pEmptyEnoughSuperblock;
+	tHeap		*pHeap = &s_hoard.heapArray[heapNum];
 	
+	if (pHeap->numMallocs + pHeap->numFrees - pHeap->adaptMallocs - pHeap->adaptFrees >= EMPTINESS_ADAPT_PERIOD)
+	{
+		adaptEmptinessThreshold(heapNum);
+	}
+	if (!isEmptyEnough(heapNum))
+	{
+		return;
+	}
 	pEmptyEnoughSuperblock = findEmptyEnoughSuperblock(heapNum);
 	DBG_MSG("pEmptyEnoughSuperblock=0x%x\n", (unsigned int)pEmptyEnoughSuperblock);
+	if (!pEmptyEnoughSuperblock)
+	{
+		return;
+	}
 	
 	while (pEmptyEnoughSuperblock  && isEmptyEnough(heapNum))
 	{
 		/* move superblock to global heap */
-		moveSuperblockFromTo(heapNum, GLOBAL_HEAP, pEmptyEnoughSuperblock);
+		moveSuperblockToGlobal(heapNum, pEmptyEnoughSuperblock);
 		pEmptyEnoughSuperblock = findEmptyEnoughSuperblock(heapNum);		
 	}
 }		
 
+/* A superblock that goes to the global heap and comes back a little later is a round trip - two transfers, and a
+new init of the superblock if it was recycled, for nothing. Count them over the last period. Many round trips mean the heap
+is hovering around the emptiness threshold, so it keeps more memory: K doubles and f grows. Once the round trips stopped,
+holding on is what stops them, so both only fall back towards the configured values when the heap is mostly freeing -
+winding down rather than churning */
+static void adaptEmptinessThreshold(unsigned int heapNum)
+{
+	tHeap			*pHeap = &s_hoard.heapArray[heapNum];
+	unsigned long	toGlobal, fromGlobal, roundTrips, mallocs, frees;
+	
+	mallocs = pHeap->numMallocs - pHeap->adaptMallocs;
+	frees = pHeap->numFrees - pHeap->adaptFrees;
+	toGlobal = pHeap->numToGlobal - pHeap->adaptToGlobal;
+	fromGlobal = pHeap->numFromGlobal - pHeap->adaptFromGlobal;
+	roundTrips = toGlobal < fromGlobal ? toGlobal : fromGlobal;
+	
+	/* over the soft limit holding on to memory is what we can't afford - see relievePressure */
+	if (roundTrips >= EMPTINESS_THRASH_ROUND_TRIPS &&
+		!(s_config.softLimit && __atomic_load_n(&s_hoard.footprint, __ATOMIC_RELAXED) > s_config.softLimit))
+	{
+		pHeap->emptyThresholdK = pHeap->emptyThresholdK ? 2 * pHeap->emptyThresholdK : 1;
+		if (pHeap->emptyThresholdK > s_config.emptyThresholdKMax)
+		{
+			pHeap->emptyThresholdK = s_config.emptyThresholdKMax;
+		}
+		pHeap->fullnessF += FULLNESS_THRESHOLD_F_STEP;
+		if (pHeap->fullnessF > s_config.fullnessFMax)
+		{
+			pHeap->fullnessF = s_config.fullnessFMax;
+		}
+	}
+	else if (!roundTrips && frees > EMPTINESS_WINDDOWN_RATIO * mallocs)
+	{
+		pHeap->emptyThresholdK /= 2;
+		if (pHeap->emptyThresholdK < s_config.emptyThresholdK)
+		{
+			pHeap->emptyThresholdK = s_config.emptyThresholdK;
+		}
+		pHeap->fullnessF -= FULLNESS_THRESHOLD_F_STEP;
+		if (pHeap->fullnessF < s_config.fullnessF)
+		{
+			pHeap->fullnessF = s_config.fullnessF;
+		}
+	}
+	DBG_MSG("heap %d round trips %lu: K %d f %f\n", heapNum, roundTrips, pHeap->emptyThresholdK, pHeap->fullnessF);
+	
+	pHeap->adaptMallocs = pHeap->numMallocs;
+	pHeap->adaptFrees = pHeap->numFrees;
+	pHeap->adaptToGlobal = pHeap->numToGlobal;
+	pHeap->adaptFromGlobal = pHeap->numFromGlobal;
+}
+
+/* The background maintenance thread. It wakes up every s_config.maintenanceMs and does the housekeeping that would
+otherwise run inside mallocs and frees. It never waits for a heap or a cpu cache - whatever is busy is left for the next tick */
+static void *	maintenanceThread(void *pArg)
+{
+	for (;;)
+	{
+		usleep(s_config.maintenanceMs * 1000);
+		__atomic_add_fetch(&s_hoard.maintenanceTicks, 1, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&s_hoard.underPressure, __ATOMIC_RELAXED))
+		{
+			relievePressure();
+		}
+		maintainHeaps();
+		maintainRegions(MAINTENANCE_DECAY_TICKS);
+		refillCpuCaches();
+	}
+	return 0;
+}
+
+/* Move f-empty superblocks to the global heap from heaps that freed since the last tick. A heap that went idle also
+drops its own f and K back to the configured values, so its memory is not held on to for a burst that is over */
+static void		maintainHeaps(void)
+{
+	tHeap			*pHeap;
+	unsigned int	heap;
+	unsigned long	ops;
+	
+	for (heap = 1; heap < s_config.numHeaps; heap++)
+	{
+		pHeap = &s_hoard.heapArray[heap];
+		ops = __atomic_load_n(&pHeap->numMallocs, __ATOMIC_RELAXED) + __atomic_load_n(&pHeap->numFrees, __ATOMIC_RELAXED);
+		pHeap->idleTicks = (ops == pHeap->maintenanceOps) ? pHeap->idleTicks + 1 : 0;
+		pHeap->maintenanceOps = ops;
+		
+		if (!__atomic_load_n(&pHeap->needsMaintenance, __ATOMIC_RELAXED) && pHeap->idleTicks != MAINTENANCE_IDLE_TICKS)
+		{
+			continue;
+		}
+		if (pthread_mutex_trylock(&pHeap->mutex))
+		{
+			continue;
+		}
+		pHeap->needsMaintenance = 0;
+		if (pHeap->idleTicks == MAINTENANCE_IDLE_TICKS)
+		{
+			pHeap->emptyThresholdK = s_config.emptyThresholdK;
+			pHeap->fullnessF = s_config.fullnessF;
+		}
+		checkInvariantAndMoveSuperblocks(heap);
+		unlockHeap(heap);
+	}
+}
+
+/* Give the memory of superblocks that sat in the global heap's empty pool for decayTicks back to the OS,
+and of whole regions once all their superblocks are idle. Superblocks of a huge page region are never purged one by one -
+that would split the huge page. The region mutex keeps heaps from taking a superblock back while it is purged.
+Returns the number of purges */
+static unsigned int	maintainRegions(unsigned long decayTicks)
+{
+	tRegion			*pRegion;
+	tSuperblock		*pSuperblock;
+	unsigned int	i, numPurged = 0;
+	
+	pthread_mutex_lock(&s_hoard.regionMutex);
+	for (pRegion = s_hoard.pRegions; pRegion; pRegion = pRegion->pNext)
+	{
+		if (!pRegion->numIdle || pRegion->isPurged)
+		{
+			continue;
+		}
+		if (pRegion->numIdle == pRegion->numSuperblocks)
+		{
+			numPurged += purgeRegion(pRegion);
+			continue;
+		}
+		if (pRegion->isHuge)
+		{
+			continue;
+		}
+		for (i = 0; i < pRegion->numCarved; i++)
+		{
+			pSuperblock = &pRegion->superblocks[i];
+			if (pSuperblock->isIdle && !pSuperblock->isPurged &&
+				s_hoard.maintenanceTicks - pSuperblock->idleSince >= decayTicks)
+			{
+				if (!madvise(pSuperblock->pBlockArray, (size_t)1 << pSuperblock->spanOrder, MADV_DONTNEED))
+				{
+					pSuperblock->isPurged = 1;
+					pRegion->purgedBytes += (size_t)1 << pSuperblock->spanOrder;
+					creditFootprint((size_t)1 << pSuperblock->spanOrder);
+					numPurged++;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&s_hoard.regionMutex);
+	return numPurged;
+}
+
+/* Top up the size classes that mallocs on a cpu drained below CPU_CACHE_LOW_WATER, so the next mallocs there don't
+have to refill the cache themselves. The blocks come from the maintenance thread's own heap */
+static void		refillCpuCaches(void)
+{
+	tCpuCache		*pCache;
+	unsigned int	cpu, sizeClass, heapNum, numRefilled, i, lowWater;
+	
+	if (!s_hoard.useCpuCaches || !getHeapNumber(&heapNum))
+	{
+		return;
+	}
+	for (cpu = 0; cpu < MAX_CPUS; cpu++)
+	{
+		pCache = &s_hoard.cpuCaches[cpu];
+		if (!__atomic_load_n(&pCache->lowWater, __ATOMIC_RELAXED) || !tryLockCpuCache(cpu))
+		{
+			continue;
+		}
+		/* rseq sections set bits without taking busy, so take the bits and clear them in one go */
+		lowWater = __atomic_exchange_n(&pCache->lowWater, 0, __ATOMIC_RELAXED);
+		lockHeap(heapNum);
+		for (sizeClass = 0; sizeClass < RECYCLED_CLASS; sizeClass++)
+		{
+			if (!(lowWater & (1U << sizeClass)))
+			{
+				continue;
+			}
+			if (pCache->numBlocks[sizeClass] >= CPU_CACHE_BATCH)
+			{
+				continue;
+			}
+			numRefilled = allocMemBatch(heapNum, sizeClass, &pCache->pBlocks[sizeClass][pCache->numBlocks[sizeClass]],
+										CPU_CACHE_BATCH - pCache->numBlocks[sizeClass]);
+			for (i = 0; i < numRefilled; i++)
+			{
+				pCache->pBlocks[sizeClass][pCache->numBlocks[sizeClass]++]->inUse = BLOCK_CACHED;
+			}
+		}
+		unlockHeap(heapNum);
+		unlockCpuCache(pCache);
+	}
+}
+
 static void lockHeap(unsigned int heapNum)
 {
+	tHeap	*pHeap = &s_hoard.heapArray[heapNum];
+	
 	DBG_MSG("lockHeap %d\n", heapNum);
-	/* maybe no need to lock heaps - just lock the shared resource which is the global heap. */
-	if (GLOBAL_HEAP != heapNum)
+	/* several threads hash to the same heap, so every heap needs its lock. Try first, so that contention can be noticed */
+	if (!pthread_mutex_trylock(&pHeap->mutex))
 	{
 		return;
 	}
-	pthread_mutex_lock(&s_hoard.heapArray[heapNum].mutex);
+	__atomic_add_fetch(&pHeap->numContended, 1, __ATOMIC_RELAXED);
+	if ((int)heapNum == t_heapNum)
+	{
+		t_heapContention++;
+	}
+	pthread_mutex_lock(&pHeap->mutex);
 }
 
 static void unlockHeap(unsigned int heapNum)
 {
 	DBG_MSG("unlockHeap %d\n", heapNum);
-	if (GLOBAL_HEAP != heapNum)
-	{
-		return;
-	}
 	pthread_mutex_unlock(&s_hoard.heapArray[heapNum].mutex);
 }
 
@@ -1060,7 +4904,8 @@ static void unlockClass(unsigned int heapNum, unsigned int sizeClass)
 #ifdef DEBUG_MODE
 static void dumpHoard(char *title)
 {
-	int				heap, class;
+	int				heap, class, node, stack;
+	unsigned int	index;
 	tHeap			*pHeap;
 	tSizeClass		*pClass;
 	tSuperblock		*pSb;
@@ -1070,7 +4915,7 @@ static void dumpHoard(char *title)
 	
 	if (title) {printf("%s\n", title);} else {printf("\n");}
 	
-	for (heap = 0; heap < NUM_HEAPS; heap++)
+	for (heap = 0; heap < s_config.numHeaps; heap++)
 	{
 		lockHeap(heap);
 		pHeap = &s_hoard.heapArray[heap];
@@ -1096,6 +4941,32 @@ static void dumpHoard(char *title)
 		}
 		unlockHeap(heap);	
 	}
+	/* the global heap keeps its superblocks on lock-free stacks. Not a consistent snapshot, but good enough for debugging */
+	for (class = 0; class < (RECYCLED_CLASS + NUM_SPAN_ORDERS) * (int)s_hoard.numNodes; class++)
+	{
+		node = class / (RECYCLED_CLASS + NUM_SPAN_ORDERS);
+		stack = class % (RECYCLED_CLASS + NUM_SPAN_ORDERS);
+		if (stack < RECYCLED_CLASS)
+		{
+			index = (unsigned int)__atomic_load_n(&s_hoard.globalStacks[node][stack].top, __ATOMIC_ACQUIRE);
+		}
+		else
+		{
+			index = (unsigned int)__atomic_load_n(&s_hoard.emptyStacks[node][stack - RECYCLED_CLASS].top, __ATOMIC_ACQUIRE);
+		}
+		if (index)
+		{
+			printf("node %d global stack %s #%d:\n", node, stack < RECYCLED_CLASS ? "class" : "empty span", stack < RECYCLED_CLASS ? stack : stack - RECYCLED_CLASS + MIN_SPAN_ORDER);
+		}
+		while (index)
+		{
+			pSb = getSuperblockByIndex(index);
+			printf("Superblock: index=%d sizeClass=%d blockSize=%d ownerHeap=%d numBlocks=%d numFreeBlocks=%d pBlockArray=0x%x\n",
+					pSb->index, pSb->sizeClass, pSb->blockSize, pSb->ownerHeap, pSb->numBlocks,
+					pSb->numFreeBlocks, (unsigned int)pSb->pBlockArray);
+			index = pSb->nextInStack;
+		}
+	}
 	printf("--------------------END HOARD DUMP ------------------------------------\n");
 }
 #endif /*DEBUG_MODE*/
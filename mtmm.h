@@ -1,6 +1,10 @@
 #ifndef __MTMM__H__
 #define __MTMM__H__
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 // The minimum allocation grain for a given object
 #define SUPERBLOCK_SIZE 65536
@@ -62,6 +66,14 @@ to heap 0 (the global heap).
 void free (void * ptr) ;
 
 
+/*
+
+The calloc() function allocates memory for an array of num elements of sz bytes each and returns a pointer
+to the allocated memory. The memory is set to zero. Returns NULL if num * sz overflows.
+*/
+void * calloc (size_t num, size_t sz);
+
+
 /*
 
 The realloc() function changes the size of the memory block pointed to by ptr to size bytes. 
@@ -73,13 +85,286 @@ is equivalent to free(ptr). Unless ptr is NULL, it must have been returned by an
 call to malloc(), calloc() or realloc(). If the area pointed to was moved, a free(ptr) is done. 
 
 
-1. allocate sz bytes
-2. copy from old location to a new one
-3. free old allocation
+1. if the block already holds sz bytes and isn't more than twice that, return ptr as it is
+2. otherwise allocate sz bytes
+3. copy from old location to a new one
+4. free old allocation
 */
 void * realloc (void * ptr, size_t sz) ;
 
 
+/*
+
+Aligned allocation. alignment must be a power of two - for posix_memalign() also a multiple of sizeof(void *).
+Memory from all of them is freed with free(). Blocks of a size class are aligned to their size up to 32 bytes,
+so alignments up to 32 cost nothing extra. A bigger alignment takes the aligned object out of a block that much
+bigger, with a block header of its own right in front of it.
+posix_memalign() returns 0, EINVAL for a bad alignment or ENOMEM. valloc() aligns to the page size, and pvalloc()
+rounds the size up to a whole number of pages as well.
+*/
+int posix_memalign(void **memptr, size_t alignment, size_t sz);
+void * aligned_alloc(size_t alignment, size_t sz);
+void * memalign(size_t alignment, size_t sz);
+void * valloc(size_t sz);
+void * pvalloc(size_t sz);
+
+
+/*
+
+The rest of the glibc malloc interface, so the shared library can stand in for glibc's malloc under LD_PRELOAD.
+malloc_usable_size() is the size of the block, at least what was asked for. malloc_trim() hands every completely
+empty superblock and medium chunk to the global heap and gives all idle memory back to the OS right away - it
+returns 1 if any memory was released. mallinfo2() needs <malloc.h>. reallocarray() is realloc(ptr, num * sz)
+that fails with ENOMEM if the product overflows.
+*/
+size_t malloc_usable_size(void *ptr);
+int malloc_trim(size_t pad);
+struct mallinfo2 mallinfo2(void);
+void * reallocarray(void *ptr, size_t num, size_t sz);
+
+
+/*
+
+Size class slack. Every allocation is rounded up - to a power of two below 32KB, to a buddy block less its 32 byte
+header in the medium tier, to whole pages for an mmap - and the rest of the block is the caller's to use.
+mtmm_good_size() is the usable size malloc(sz) would give, without allocating: a vector or string buffer that grows
+to mtmm_good_size(wanted) uses the slack instead of wasting it. Where a block reaches the threshold of the next tier
+the answer stops one byte short of it: sizes from 16KB up to 32KB get 32767, not 32768, because malloc(32768) is
+already a 64KB medium block. So mtmm_good_size(mtmm_good_size(sz)) == mtmm_good_size(sz), and malloc() of the answer
+gets the same block. mtmm_usable_size() is malloc_usable_size().
+mtmm_malloc_at_least() is malloc() that also stores the usable size in *pUsable (0 if it fails). All of the usable
+size may be written, and realloc() within it doesn't move the block.
+*/
+size_t mtmm_good_size(size_t sz);
+size_t mtmm_usable_size(void *ptr);
+void * mtmm_malloc_at_least(size_t sz, size_t *pUsable);
+
+
+/*
+
+Sized free (C23). sz must be the size ptr was allocated with - from malloc(), calloc() (num * sz) or realloc() -
+and for free_aligned_sized() the alignment too, from aligned_alloc(). Any size from that up to the usable size
+will do, so a buffer from mtmm_malloc_at_least() may be freed with the size it was granted. Knowing the size saves the fast path
+loading the block's superblock descriptor to find its size class - the block header right in front of ptr is still read.
+mtmm_new.cpp routes C++ sized delete here.
+*/
+void free_sized(void *ptr, size_t sz);
+void free_aligned_sized(void *ptr, size_t alignment, size_t sz);
+
+
+/*
+
+Allocation with the size class resolved at compile time. Blocks below 32KB come from power of two size classes:
+class c holds blocks of 1 << c bytes. For a constant size - typically sizeof(T) - mtmm_malloc() and mtmm_free()
+compute the class at compile time and call straight into that class, without the indirect call of malloc().
+mtmm_malloc_class() still checks sz against the threshold set at run time (MTMM_OPT_HOARD_THRESHOLD), so it hands out
+the same kind of block malloc(sz) would. Any other size goes to malloc() and free_sized(). Either way the memory may
+be freed with free(). mtmm_free() needs the size that was passed to mtmm_malloc().
+*/
+#define MTMM_NUM_SIZE_CLASSES	16
+/* the largest size the classes serve - malloc(32768) is a medium block */
+#define MTMM_MAX_CLASS_SIZE		((1UL << (MTMM_NUM_SIZE_CLASSES - 1)) - 1)
+/* log2 of the block size for sz. Size 0 gets a block of 1 byte, like malloc(0) */
+#define MTMM_SIZE_CLASS(sz)		((sz) <= 1 ? 0U : (unsigned int)(sizeof(unsigned long) * 8 - __builtin_clzl((unsigned long)(sz) - 1)))
+
+/* sizeClass is MTMM_SIZE_CLASS(sz) */
+void * mtmm_malloc_class(unsigned int sizeClass, size_t sz);
+void mtmm_free_class(void *ptr, unsigned int sizeClass);
+
+static inline void * mtmm_malloc(size_t sz)
+{
+	if (__builtin_constant_p(sz) && sz <= MTMM_MAX_CLASS_SIZE)
+	{
+		return mtmm_malloc_class(MTMM_SIZE_CLASS(sz), sz);
+	}
+	return malloc(sz);
+}
+
+static inline void mtmm_free(void *ptr, size_t sz)
+{
+	if (__builtin_constant_p(sz) && sz <= MTMM_MAX_CLASS_SIZE)
+	{
+		mtmm_free_class(ptr, MTMM_SIZE_CLASS(sz));
+		return;
+	}
+	free_sized(ptr, sz);
+}
+
+
+/*
+
+Tuning parameters. The defaults are the compile time ones in mtmm.c. They can be set in the environment, read once
+on the first allocation, as a comma separated list of name:value pairs - the names are in brackets. Sizes may end with k or m.
+For example MTMM_CONF=heaps:32,f:0.25,k:4
+
+MTMM_OPT_HEAPS				(heaps)		number of heaps including the global heap, 2 to 64
+MTMM_OPT_FULLNESS_F			(f)			emptiness fraction f of the emptiness invariant, between 0 and 1
+MTMM_OPT_EMPTY_K			(k)			number of empty superblocks K a heap may hold before it gives any to the global heap
+MTMM_OPT_FULLNESS_F_MAX		(fmax)		each heap tunes its own f between f and this, less than 1. Set to f to keep f fixed
+MTMM_OPT_EMPTY_K_MAX		(kmax)		each heap tunes its own K between K and this, up to 1024. Set to K to keep K fixed
+MTMM_OPT_HOARD_THRESHOLD	(threshold)	objects this size and bigger don't come from superblocks. Up to S/2
+MTMM_OPT_MMAP_THRESHOLD		(mmap)		objects this size and bigger get their own mmap, smaller ones above the hoard threshold come
+										from the medium tier. Up to 1MB less the block header
+MTMM_OPT_SUPERBLOCK_MIN		(sbmin)		smallest superblock size, a power of two from 8KB to 2MB
+MTMM_OPT_SUPERBLOCK_OBJECTS	(sbobjs)	minimum number of blocks per superblock, 1 to 1024
+MTMM_OPT_MAINTENANCE_MS		(bg)		run a background thread every this many milliseconds that moves empty superblocks to the
+										global heap, purges idle memory and refills per-cpu caches - instead of doing it inside
+										malloc and free. 0 (the default) for no background thread
+MTMM_OPT_SOFT_LIMIT			(soft)		the soft limit of the memory budget in bytes, see mtmm_set_budget. May end with g too
+MTMM_OPT_HARD_LIMIT			(hard)		the hard limit of the memory budget in bytes
+
+On a NUMA machine the heaps are split between the nodes - give at least one heap per node, or all of them share node 0 - and
+every thread uses a heap of the node it runs on. Superblock and medium chunk memory is bound to the node of the heap that maps
+it, each node has a global heap of its own, and memory only crosses nodes when its own node has no more. The nodes come
+from sysfs. MTMM_NUMA replaces them with made up ones for testing: cpu lists separated by slashes, for example
+MTMM_NUMA=0-3,8-11/4-7,12-15. MTMM_NUMA=0 is a single node.
+*/
+#define MTMM_OPT_HEAPS					1
+#define MTMM_OPT_FULLNESS_F				2
+#define MTMM_OPT_EMPTY_K				3
+#define MTMM_OPT_HOARD_THRESHOLD		4
+#define MTMM_OPT_MMAP_THRESHOLD			5
+#define MTMM_OPT_SUPERBLOCK_MIN			6
+#define MTMM_OPT_SUPERBLOCK_OBJECTS		7
+#define MTMM_OPT_FULLNESS_F_MAX			8
+#define MTMM_OPT_EMPTY_K_MAX			9
+#define MTMM_OPT_MAINTENANCE_MS			10
+#define MTMM_OPT_SOFT_LIMIT				11
+#define MTMM_OPT_HARD_LIMIT				12
+
+/*
+
+Set a tuning parameter. Overrides MTMM_CONF. Only works before the first allocation, and is not thread safe.
+Returns 1 on success, 0 if the parameter or the value is not valid or memory was already allocated.
+*/
+int mtmm_mallopt(int param, double value);
+
+
+/*
+
+Statistics of one heap. Heap 0 is the global heap - its transfer counts are the totals over all the other heaps.
+A heap that keeps sending superblocks to the global heap and taking them back raises its own K and f, to stop
+the ping-pong. Once that stops they fall back to the configured values.
+*/
+typedef struct sMtmmHeapStats
+{
+	size_t			memoryInUse;			/* u - memory in blocks handed out */
+	size_t			memoryHeld;				/* a - memory in the superblocks the heap holds */
+	unsigned long	transfersToGlobal;		/* superblocks given to the global heap */
+	unsigned long	transfersFromGlobal;	/* superblocks taken from the global heap */
+	unsigned int	emptyThresholdK;		/* the heap's current K */
+	double			fullnessF;				/* the heap's current f */
+} tMtmmHeapStats;
+
+/*
+
+Fill in the statistics of the given heap. Returns 1 on success, 0 if there is no such heap - so calling it with
+heap 0, 1, 2... until it returns 0 walks all heaps.
+*/
+int mtmm_heap_stats(unsigned int heap, tMtmmHeapStats *pStats);
+
+
+/*
+
+Reserve memory ahead of time, so the first mallocs of a service don't pay for carving superblocks, laying out their
+blocks and faulting in their pages. mtmm_reserve() readies empty superblocks with room for count objects of size sz -
+the size class of 1 << c is reserved with sz = 1 << c. The superblocks are spread over the heaps as far as their
+emptiness invariant lets them keep them, the rest wait ready in the global heap. Returns 1 on success, 0 if sz doesn't
+come from superblocks (see MTMM_OPT_HOARD_THRESHOLD) or out of memory - whatever was reserved by then stays.
+malloc_trim() gives back a reserve that is still unused, like any other empty memory.
+
+The same can be done at startup from the environment: MTMM_RESERVE is a list of size:count pairs, for example
+MTMM_RESERVE=64:100k,4k:500 - or @ and the name of a file of pairs, separated by commas, spaces or new lines.
+*/
+int mtmm_reserve(size_t sz, size_t count);
+
+
+/*
+
+Memory budget. The footprint is the memory mapped from the OS and not purged since - superblock regions, medium
+chunks and large objects. Past the soft limit the allocator gives back what it can: the heaps drop their K and f to
+the configured values and stop raising them, and every empty superblock and medium chunk is purged - when the
+footprint crosses the limit, and again for every 2MB it grows beyond. Mapping new memory past the hard limit fails - first the allocator purges and
+tries once more, and if that fails too malloc returns NULL with errno ENOMEM. Purged memory counts as new memory
+once it is taken back into use. 0 means no limit.
+
+The callback, if not NULL, runs with level MTMM_PRESSURE_SOFT before the soft limit purge and with MTMM_PRESSURE_HARD
+before the hard limit retry - the moment to drop caches. It runs on an allocating thread (or the maintenance thread)
+with no allocator lock held, and may call free() and malloc(). It runs inside a malloc() call, which compilers assume
+leaves the program's variables alone - keep what it changes volatile or atomic. mtmm_set_budget() may be called at
+any time, the limits can also be set in MTMM_CONF. Returns 0 if the soft limit is above the hard limit.
+*/
+#define MTMM_PRESSURE_SOFT				1
+#define MTMM_PRESSURE_HARD				2
+
+int mtmm_set_budget(size_t softLimit, size_t hardLimit, void (*pCallback)(int level, size_t footprint));
+size_t mtmm_footprint(void);
+
+
+/*
+
+Heap snapshot. mtmm_snapshot() writes the layout of the heaps to fd - every heap's statistics, every superblock with
+its size class, owner, state and how many of its blocks are in use, and every medium chunk. The format is in
+mtmm_snapshot.h. mtmm_analyze reads it and reports internal and external fragmentation per size class, heaps that
+hoard nearly empty superblocks, and an MTMM_RESERVE profile for the next run from the most blocks of each size class
+that were ever in use at once. The heaps keep running while the
+snapshot is taken and it doesn't allocate, so it may be called from anywhere but a signal handler. Returns 0 if a
+write failed or nothing was allocated yet. With MTMM_SNAPSHOT=file in the environment a snapshot is written to the
+file when the process exits.
+*/
+int mtmm_snapshot(int fd);
+
+
+/*
+
+Arenas. Many small objects that die together - the nodes of a parse tree, the buffers of one request - are bump
+allocated out of whole superblocks, with no block header and no per-object free. Reset gives them all back at once,
+for as long as it takes to return a handful of superblocks. Memory from an arena must not be passed to free() or
+realloc(). An arena is not thread safe: one thread at a time may use it, though not always the same one.
+*/
+typedef struct sMtmmArena tMtmmArena;
+
+/* A new empty arena. NULL if out of memory */
+tMtmmArena * mtmm_arena_create(void);
+
+/* sz bytes from the arena, aligned to 16 bytes (smaller objects to their size rounded up to a power of two).
+NULL if sz is 0 or out of memory */
+void * mtmm_arena_alloc(tMtmmArena *pArena, size_t sz);
+
+/* Free everything allocated from the arena. The arena keeps one superblock for what comes next */
+void mtmm_arena_reset(tMtmmArena *pArena);
+
+/* Free everything allocated from the arena and the arena itself */
+void mtmm_arena_destroy(tMtmmArena *pArena);
+
+
+/*
+
+Object caches. A cache hands out objects of one size for a hot structure, packed back to back in superblocks of
+their own - a 72 byte structure takes 72 bytes, not a 128 byte block plus a header. The constructor, if any, runs
+once when an object is first carved. A freed object is not written to, so it comes back from mtmm_cache_alloc()
+still constructed - unless memory ran so short that no magazine could be had to keep it in: such an object is linked
+into the cache through its first bytes and constructed again when it is handed out. Allocating and freeing goes
+through a per-thread magazine of free objects without locking.
+A cache keeps its memory for the life of the process. Up to 64 caches can be created.
+*/
+typedef struct sMtmmCache tMtmmCache;
+
+/* A new cache for objects of objSize bytes, up to 256KB, aligned to align - a power of two, or 0 for the biggest power
+of two up to 16 that objSize is a multiple of. ctor may be NULL. NULL on failure */
+tMtmmCache * mtmm_cache_create(size_t objSize, size_t align, void (*ctor)(void *));
+
+/* An object from the cache. NULL if out of memory */
+void * mtmm_cache_alloc(tMtmmCache *pCache);
+
+/* Give an object back to the cache it came from. It must not be passed to free() */
+void mtmm_cache_free(tMtmmCache *pCache, void *p);
+
+
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
@@ -0,0 +1,524 @@
+/* Offline analyzer of mtmm heap snapshots - see mtmm_snapshot() in mtmm.h and the format in mtmm_snapshot.h */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "mtmm_snapshot.h"
+
+#define MAX_SIZE_CLASSES		64
+#define MAX_SPAN_ORDERS			64
+#define OCCUPANCY_BUCKETS		10		/* histogram of superblock occupancy in steps of 10% */
+#define SPARSE_OCCUPANCY		0.25	/* a superblock of a heap this empty or emptier is hoarded memory */
+#define HOARDING_RATIO			0.5		/* a heap is flagged when this much of what it holds is in sparse superblocks */
+#define FORMAT_BUFFERS			4
+
+/* what the superblocks of one size class add up to */
+typedef struct sClassSummary
+{
+	unsigned long		numSuperblocks;
+	uint64_t			heldBytes;				/* the spans of the superblocks */
+	uint64_t			numBlocks;
+	uint64_t			numInUse;				/* blocks the program has */
+	uint64_t			numCached;				/* blocks parked in cpu caches */
+	uint64_t			requestedBytes;
+	uint64_t			peakBlocksOut;			/* the most blocks in use and cached at once, 0 if the writer didn't record it */
+	unsigned long		occupancy[OCCUPANCY_BUCKETS + 1];	/* the last bucket is for completely full superblocks */
+} tClassSummary;
+
+typedef struct sHeapSummary
+{
+	tMtmmSnapHeap		heap;
+	unsigned long		numSuperblocks;
+	uint64_t			heldBytes;
+	unsigned long		numSparse;				/* superblocks at most SPARSE_OCCUPANCY full */
+	uint64_t			sparseBytes;
+	uint64_t			sparseInUseBytes;
+	unsigned long		numRemote;				/* superblocks on another NUMA node than the heap */
+	unsigned long		numMediumChunks;
+	uint64_t			mediumFreeUnits;
+	uint64_t			mediumLargestFreeUnits;	/* sum over the chunks of their biggest free block */
+} tHeapSummary;
+
+/* superblocks outside the heaps, by span */
+typedef struct sSpanSummary
+{
+	unsigned long		numIdle;
+	unsigned long		numPurged;
+	unsigned long		numLent;
+} tSpanSummary;
+
+static tMtmmSnapHeader	s_header;
+static tClassSummary	s_classes[MAX_SIZE_CLASSES + 1];	/* the last one for superblocks of no class */
+static tHeapSummary		*s_pHeaps;
+static tSpanSummary		s_spans[MAX_SPAN_ORDERS];
+static unsigned long	s_numRecords;
+static int				s_isComplete;
+static unsigned long	s_numInconsistent;		/* superblock records with more free and cached blocks than blocks */
+
+/* the whole input in memory. Returns NULL on a read error */
+static char *	readInput(FILE *pFile, size_t *pSize);
+
+/* go over the records and add them up. Returns 0 if the input is not a snapshot */
+static int		parseSnapshot(const char *pData, size_t size);
+
+/* copy a record into a zeroed struct of the size this program knows - shorter records are from an older writer, longer ones from a newer */
+static void		copyRecord(void *pDest, size_t destSize, const char *pRecord, uint32_t recordSize);
+
+static void		addSuperblock(const tMtmmSnapSuperblock *pSuperblock);
+static void		addMediumChunk(const tMtmmSnapMediumChunk *pChunk);
+
+static void		printReport(void);
+static void		printReserveProfile(void);
+
+/* bytes with a unit, in one of FORMAT_BUFFERS static buffers so that many may be printed together */
+static const char *	formatBytes(uint64_t bytes);
+
+static void		usage(const char *pName)
+{
+	fprintf(stderr, "usage: %s [-r] [snapshot]\n", pName);
+	fprintf(stderr, "  reads a snapshot written by mtmm_snapshot() or MTMM_SNAPSHOT=file - standard input if no file is given\n");
+	fprintf(stderr, "  -r  print an MTMM_RESERVE profile of the most blocks ever in use instead of the report\n");
+}
+
+int main(int argc, char *argv[])
+{
+	FILE			*pFile = stdin;
+	char			*pData;
+	size_t			size;
+	int				opt, isReserve = 0;
+
+	while (-1 != (opt = getopt(argc, argv, "rh")))
+	{
+		switch (opt)
+		{
+			case 'r':
+				isReserve = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (optind < argc)
+	{
+		pFile = fopen(argv[optind], "rb");
+		if (!pFile)
+		{
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+	pData = readInput(pFile, &size);
+	if (pFile != stdin)
+	{
+		fclose(pFile);
+	}
+	if (!pData)
+	{
+		perror("read");
+		return 1;
+	}
+	if (!parseSnapshot(pData, size))
+	{
+		fprintf(stderr, "not an mtmm snapshot, or of an unknown version\n");
+		return 1;
+	}
+	if (!s_isComplete)
+	{
+		fprintf(stderr, "warning: the snapshot was cut short - the numbers are incomplete\n");
+	}
+	if (isReserve)
+	{
+		printReserveProfile();
+	}
+	else
+	{
+		printReport();
+	}
+	free(pData);
+	free(s_pHeaps);
+	return 0;
+}
+
+static char *	readInput(FILE *pFile, size_t *pSize)
+{
+	char			*pData = 0, *pBigger;
+	size_t			capacity = 0, n;
+
+	*pSize = 0;
+	do
+	{
+		if (*pSize == capacity)
+		{
+			capacity = capacity ? 2 * capacity : 65536;
+			pBigger = realloc(pData, capacity);
+			if (!pBigger)
+			{
+				free(pData);
+				return 0;
+			}
+			pData = pBigger;
+		}
+		n = fread(pData + *pSize, 1, capacity - *pSize, pFile);
+		*pSize += n;
+	} while (n);
+	if (ferror(pFile))
+	{
+		free(pData);
+		return 0;
+	}
+	return pData;
+}
+
+static int		parseSnapshot(const char *pData, size_t size)
+{
+	tMtmmSnapRecord			record;
+	tMtmmSnapHeap			heap;
+	tMtmmSnapSizeClass		sizeClass;
+	tMtmmSnapSuperblock		superblock;
+	tMtmmSnapMediumChunk	chunk;
+	size_t					offset;
+
+	if (size < sizeof(tMtmmSnapRecord))
+	{
+		return 0;
+	}
+	memcpy(&record, pData, sizeof(record));
+	if (MTMM_SNAP_HEADER != record.type || record.size > size)
+	{
+		return 0;
+	}
+	copyRecord(&s_header, sizeof(s_header), pData, record.size);
+	if (MTMM_SNAPSHOT_MAGIC != s_header.magic || MTMM_SNAPSHOT_VERSION != s_header.version ||
+		!s_header.numHeaps || s_header.numSizeClasses > MAX_SIZE_CLASSES)
+	{
+		return 0;
+	}
+	s_pHeaps = calloc(s_header.numHeaps, sizeof(tHeapSummary));
+	if (!s_pHeaps)
+	{
+		return 0;
+	}
+	for (offset = 0; offset + sizeof(record) <= size; offset += record.size)
+	{
+		memcpy(&record, pData + offset, sizeof(record));
+		if (record.size < sizeof(record) || record.size > size - offset)
+		{
+			/* cut off in the middle of a record */
+			break;
+		}
+		switch (record.type)
+		{
+			case MTMM_SNAP_HEAP:
+				copyRecord(&heap, sizeof(heap), pData + offset, record.size);
+				if (heap.heap < s_header.numHeaps)
+				{
+					s_pHeaps[heap.heap].heap = heap;
+				}
+				break;
+			case MTMM_SNAP_SIZE_CLASS:
+				copyRecord(&sizeClass, sizeof(sizeClass), pData + offset, record.size);
+				if (sizeClass.sizeClass < s_header.numSizeClasses)
+				{
+					s_classes[sizeClass.sizeClass].peakBlocksOut = sizeClass.peakBlocksOut;
+				}
+				break;
+			case MTMM_SNAP_SUPERBLOCK:
+				copyRecord(&superblock, sizeof(superblock), pData + offset, record.size);
+				addSuperblock(&superblock);
+				break;
+			case MTMM_SNAP_MEDIUM_CHUNK:
+				copyRecord(&chunk, sizeof(chunk), pData + offset, record.size);
+				addMediumChunk(&chunk);
+				break;
+			case MTMM_SNAP_END:
+				s_isComplete = 1;
+				break;
+			default:
+				/* the header, or a record of a newer writer */
+				break;
+		}
+		if (MTMM_SNAP_END == record.type)
+		{
+			break;
+		}
+		s_numRecords++;
+	}
+	return 1;
+}
+
+static void		copyRecord(void *pDest, size_t destSize, const char *pRecord, uint32_t recordSize)
+{
+	memset(pDest, 0, destSize);
+	memcpy(pDest, pRecord, recordSize < destSize ? recordSize : destSize);
+}
+
+/* Idle and lent superblocks are outside the heaps and only counted by span. The rest are added to their size class and owner heap */
+static void		addSuperblock(const tMtmmSnapSuperblock *pSuperblock)
+{
+	tClassSummary	*pClass;
+	tHeapSummary	*pHeap;
+	uint64_t		span, inUse;
+	double			occupancy;
+
+	if (pSuperblock->spanOrder >= MAX_SPAN_ORDERS)
+	{
+		return;
+	}
+	if ((uint64_t)pSuperblock->numFreeBlocks + pSuperblock->numCachedBlocks > pSuperblock->numBlocks)
+	{
+		/* a damaged file - its occupancy would be over 100% */
+		s_numInconsistent++;
+		return;
+	}
+	span = (uint64_t)1 << pSuperblock->spanOrder;
+	if (pSuperblock->state & (MTMM_SNAP_IDLE | MTMM_SNAP_LENT))
+	{
+		s_spans[pSuperblock->spanOrder].numIdle += !!(pSuperblock->state & MTMM_SNAP_IDLE);
+		s_spans[pSuperblock->spanOrder].numLent += !!(pSuperblock->state & MTMM_SNAP_LENT);
+		s_spans[pSuperblock->spanOrder].numPurged += !!(pSuperblock->state & MTMM_SNAP_PURGED);
+		return;
+	}
+	pClass = &s_classes[pSuperblock->sizeClass < s_header.numSizeClasses ? pSuperblock->sizeClass : MAX_SIZE_CLASSES];
+	inUse = 0;
+	if (pSuperblock->sizeClass < s_header.numSizeClasses)
+	{
+		inUse = pSuperblock->numBlocks - pSuperblock->numFreeBlocks - pSuperblock->numCachedBlocks;
+	}
+	/* blocks in cpu caches are not free in the superblock either - it can't go back to the global heap */
+	occupancy = pSuperblock->numBlocks ? (double)(inUse + pSuperblock->numCachedBlocks) / pSuperblock->numBlocks : 0;
+	pClass->numSuperblocks++;
+	pClass->heldBytes += span;
+	pClass->numBlocks += pSuperblock->numBlocks;
+	pClass->numInUse += inUse;
+	pClass->numCached += pSuperblock->numCachedBlocks;
+	pClass->requestedBytes += pSuperblock->requestedBytes;
+	pClass->occupancy[(unsigned int)(occupancy * OCCUPANCY_BUCKETS)]++;
+
+	if (pSuperblock->ownerHeap >= s_header.numHeaps)
+	{
+		return;
+	}
+	pHeap = &s_pHeaps[pSuperblock->ownerHeap];
+	pHeap->numSuperblocks++;
+	pHeap->heldBytes += span;
+	/* the heap records come first, so the heap's node is known */
+	pHeap->numRemote += pSuperblock->ownerHeap && pSuperblock->node != pHeap->heap.node;
+	if (occupancy <= SPARSE_OCCUPANCY)
+	{
+		pHeap->numSparse++;
+		pHeap->sparseBytes += span;
+		if (pSuperblock->sizeClass < s_header.numSizeClasses)
+		{
+			pHeap->sparseInUseBytes += (inUse + pSuperblock->numCachedBlocks) << pSuperblock->sizeClass;
+		}
+	}
+}
+
+static void		addMediumChunk(const tMtmmSnapMediumChunk *pChunk)
+{
+	tHeapSummary	*pHeap;
+
+	if (pChunk->ownerHeap >= s_header.numHeaps)
+	{
+		return;
+	}
+	pHeap = &s_pHeaps[pChunk->ownerHeap];
+	pHeap->numMediumChunks++;
+	pHeap->mediumFreeUnits += pChunk->numFreeUnits;
+	pHeap->mediumLargestFreeUnits += pChunk->largestFreeUnits;
+}
+
+/*
+Internal fragmentation is the part of the blocks in use that the program didn't ask for - rounding up to the size class. External
+fragmentation is the part of the superblocks held that is not in blocks in use - free blocks, blocks in cpu caches, block headers and
+the ends of the spans
+*/
+static void		printReport(void)
+{
+	tClassSummary	*pClass;
+	tHeapSummary	*pHeap;
+	uint64_t		usedBytes, totalHeld = 0, totalUsed = 0, totalRequested = 0;
+	uint64_t		idleBytes = 0, purgedBytes = 0, lentBytes = 0;
+	unsigned int	class, heap, span, bucket;
+	int				isAnyFlagged = 0;
+
+	printf("Snapshot: %lu records%s\n", s_numRecords, s_isComplete ? "" : " (incomplete)");
+	if (s_numInconsistent)
+	{
+		printf("  skipped            %lu inconsistent superblock records\n", s_numInconsistent);
+	}
+	printf("  footprint          %s\n", formatBytes(s_header.footprint));
+	printf("  regions            %llu of %s\n", (unsigned long long)s_header.numRegions, formatBytes(s_header.regionSize));
+	printf("  large objects      %llu, %s\n", (unsigned long long)s_header.numLargeChunks, formatBytes(s_header.largeChunkBytes));
+	printf("  heaps              %u, the global heap included\n", s_header.numHeaps);
+	if (s_header.numNodes > 1)
+	{
+		printf("  numa nodes         %u\n", s_header.numNodes);
+	}
+
+	printf("\nSize classes:\n");
+	printf("  %8s %8s %10s %10s %10s %8s %8s %8s\n", "size", "sblocks", "held", "in use", "requested", "cached", "internal", "external");
+	for (class = 0; class <= s_header.numSizeClasses; class++)
+	{
+		pClass = &s_classes[class < s_header.numSizeClasses ? class : MAX_SIZE_CLASSES];
+		if (!pClass->numSuperblocks)
+		{
+			continue;
+		}
+		usedBytes = pClass->numInUse << class;
+		if (class == s_header.numSizeClasses)
+		{
+			printf("  %8s %8lu %10s\n", "none", pClass->numSuperblocks, formatBytes(pClass->heldBytes));
+			totalHeld += pClass->heldBytes;
+			continue;
+		}
+		printf("  %8llu %8lu %10s", 1ULL << class, pClass->numSuperblocks, formatBytes(pClass->heldBytes));
+		printf(" %10s", formatBytes(usedBytes));
+		printf(" %10s %8llu %7.1f%% %7.1f%%\n", formatBytes(pClass->requestedBytes), (unsigned long long)pClass->numCached,
+			usedBytes ? 100.0 * (usedBytes - pClass->requestedBytes) / usedBytes : 0.0,
+			100.0 * (pClass->heldBytes - usedBytes) / pClass->heldBytes);
+		totalHeld += pClass->heldBytes;
+		totalUsed += usedBytes;
+		totalRequested += pClass->requestedBytes;
+	}
+	if (totalHeld)
+	{
+		printf("  %8s %8s %10s %10s %10s %8s %7.1f%% %7.1f%%\n", "all", "", formatBytes(totalHeld), "", "", "",
+			totalUsed ? 100.0 * (totalUsed - totalRequested) / totalUsed : 0.0, 100.0 * (totalHeld - totalUsed) / totalHeld);
+	}
+
+	printf("\nSuperblock occupancy (superblocks by blocks in use or cached, in steps of %d%%):\n", 100 / OCCUPANCY_BUCKETS);
+	printf("  %8s", "size");
+	for (bucket = 0; bucket < OCCUPANCY_BUCKETS; bucket++)
+	{
+		printf(" %5u%%", bucket * 100 / OCCUPANCY_BUCKETS);
+	}
+	printf("  %5s\n", "full");
+	for (class = 0; class < s_header.numSizeClasses; class++)
+	{
+		pClass = &s_classes[class];
+		if (!pClass->numSuperblocks)
+		{
+			continue;
+		}
+		printf("  %8llu", 1ULL << class);
+		for (bucket = 0; bucket <= OCCUPANCY_BUCKETS; bucket++)
+		{
+			printf(" %6lu", pClass->occupancy[bucket]);
+		}
+		printf("\n");
+	}
+
+	printf("\nHeaps (sparse: superblocks at most %d%% in use):\n", (int)(SPARSE_OCCUPANCY * 100));
+	printf("  %4s %7s %10s %10s %8s %10s %8s %6s %6s\n", "heap", "threads", "in use", "held", "sblocks", "sparse", "sparse#", "K", "f");
+	for (heap = 0; heap < s_header.numHeaps; heap++)
+	{
+		pHeap = &s_pHeaps[heap];
+		printf("  %4u %7u %10s", heap, pHeap->heap.numThreads, formatBytes(pHeap->heap.memoryInUse));
+		printf(" %10s %8lu", formatBytes(pHeap->heap.memoryHeld), pHeap->numSuperblocks);
+		printf(" %10s %8lu %6u %6.2f", formatBytes(pHeap->sparseBytes), pHeap->numSparse, pHeap->heap.emptyThresholdK, pHeap->heap.fullnessF);
+		if (s_header.numNodes > 1)
+		{
+			printf("  node %u", pHeap->heap.node);
+			if (pHeap->numRemote)
+			{
+				printf(", %lu superblocks remote", pHeap->numRemote);
+			}
+		}
+		/* the global heap is where sparse superblocks are meant to go */
+		if (heap && pHeap->heldBytes && pHeap->sparseBytes > HOARDING_RATIO * pHeap->heldBytes)
+		{
+			printf("  hoarding - %s in use", formatBytes(pHeap->sparseInUseBytes));
+			isAnyFlagged = 1;
+		}
+		printf("\n");
+	}
+	if (isAnyFlagged)
+	{
+		printf("  A hoarding heap keeps nearly empty superblocks the emptiness invariant doesn't give up - try a lower K or f in MTMM_CONF\n");
+	}
+
+	printf("\nSuperblocks outside the heaps:\n");
+	printf("  %8s %8s %8s %8s\n", "span", "idle", "purged", "lent");
+	for (span = 0; span < MAX_SPAN_ORDERS; span++)
+	{
+		if (!s_spans[span].numIdle && !s_spans[span].numLent)
+		{
+			continue;
+		}
+		printf("  %8s %8lu %8lu %8lu\n", formatBytes(1ULL << span), s_spans[span].numIdle, s_spans[span].numPurged, s_spans[span].numLent);
+		idleBytes += (uint64_t)s_spans[span].numIdle << span;
+		purgedBytes += (uint64_t)s_spans[span].numPurged << span;
+		lentBytes += (uint64_t)s_spans[span].numLent << span;
+	}
+	printf("  idle %s, of it purged %s, lent to arenas and object caches %s\n", formatBytes(idleBytes), formatBytes(purgedBytes), formatBytes(lentBytes));
+
+	printf("\nMedium chunks (%s each, %llu purged in the free pool):\n", formatBytes(s_header.mediumChunkSize), (unsigned long long)s_header.numFreeMediumChunks);
+	printf("  %4s %7s %10s %10s %8s\n", "heap", "chunks", "free", "largest", "external");
+	for (heap = 0; heap < s_header.numHeaps; heap++)
+	{
+		pHeap = &s_pHeaps[heap];
+		if (!pHeap->numMediumChunks)
+		{
+			continue;
+		}
+		/* free memory that isn't in the biggest free block of its chunk can only serve smaller requests */
+		printf("  %4u %7lu %10s", heap, pHeap->numMediumChunks, formatBytes(pHeap->mediumFreeUnits * s_header.mediumUnitSize));
+		printf(" %10s %7.1f%%\n", formatBytes(pHeap->mediumLargestFreeUnits * s_header.mediumUnitSize),
+			pHeap->mediumFreeUnits ? 100.0 * (pHeap->mediumFreeUnits - pHeap->mediumLargestFreeUnits) / pHeap->mediumFreeUnits : 0.0);
+	}
+}
+
+/* The most blocks the program had at once - counting those in cpu caches, it had them a moment before - per size class, as pairs
+for MTMM_RESERVE. Just the pairs, so the output can be saved to a file for MTMM_RESERVE=@file or put in the environment as it is.
+A snapshot from a writer that didn't record the peaks gives the blocks in use when it was taken */
+static void		printReserveProfile(void)
+{
+	unsigned int	class;
+	uint64_t		numBlocks;
+	const char		*pSeparator = "";
+
+	for (class = 0; class < s_header.numSizeClasses; class++)
+	{
+		numBlocks = s_classes[class].peakBlocksOut;
+		if (!numBlocks)
+		{
+			numBlocks = s_classes[class].numInUse + s_classes[class].numCached;
+		}
+		if (numBlocks)
+		{
+			printf("%s%llu:%llu", pSeparator, 1ULL << class, (unsigned long long)numBlocks);
+			pSeparator = ",";
+		}
+	}
+	printf("\n");
+}
+
+static const char *	formatBytes(uint64_t bytes)
+{
+	static char		buffers[FORMAT_BUFFERS][32];
+	static int		next;
+	char			*pBuffer = buffers[next];
+
+	next = (next + 1) % FORMAT_BUFFERS;
+	if (bytes >= 10ULL << 30)
+	{
+		snprintf(pBuffer, sizeof(buffers[0]), "%lluG", (unsigned long long)(bytes >> 30));
+	}
+	else if (bytes >= 10ULL << 20)
+	{
+		snprintf(pBuffer, sizeof(buffers[0]), "%lluM", (unsigned long long)(bytes >> 20));
+	}
+	else if (bytes >= 10ULL << 10)
+	{
+		snprintf(pBuffer, sizeof(buffers[0]), "%lluK", (unsigned long long)(bytes >> 10));
+	}
+	else
+	{
+		snprintf(pBuffer, sizeof(buffers[0]), "%llu", (unsigned long long)bytes);
+	}
+	return pBuffer;
+}
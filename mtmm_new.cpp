@@ -0,0 +1,175 @@
+/*
+Replacements for every replaceable global operator new and delete, so C++ allocations go straight to mtmm instead of
+through libstdc++'s operator new. Plain new is malloc, aligned new is aligned_alloc, and sized delete is free_sized -
+the size class comes from the size instead of the block's superblock descriptor. Part of libmtmm.so and libSimpleMTMM.a.
+*/
+#include <new>
+#include <cstdlib>
+
+#include "mtmm.h"
+
+namespace
+{
+
+/* what operator new does when malloc fails: call the new handler and try again, or throw if there is none */
+void *	allocOrThrow(std::size_t sz)
+{
+	void			*p;
+
+	while (!(p = malloc(sz)))
+	{
+		std::new_handler	handler = std::get_new_handler();
+
+		if (!handler)
+		{
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+	return p;
+}
+
+/* the same for aligned new. aligned_alloc gives NULL for a size of 0 with a big alignment, so never ask for less than 1 byte */
+void *	allocAlignedOrThrow(std::size_t sz, std::align_val_t alignment)
+{
+	void			*p;
+
+	while (!(p = aligned_alloc(static_cast<std::size_t>(alignment), sz ? sz : 1)))
+	{
+		std::new_handler	handler = std::get_new_handler();
+
+		if (!handler)
+		{
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+	return p;
+}
+
+/* nothrow new goes through the new handler as well, as the standard asks */
+void *	allocNoThrow(std::size_t sz) noexcept
+{
+	try
+	{
+		return allocOrThrow(sz);
+	}
+	catch (...)
+	{
+		return 0;
+	}
+}
+
+void *	allocAlignedNoThrow(std::size_t sz, std::align_val_t alignment) noexcept
+{
+	try
+	{
+		return allocAlignedOrThrow(sz, alignment);
+	}
+	catch (...)
+	{
+		return 0;
+	}
+}
+
+}
+
+void *	operator new(std::size_t sz)
+{
+	return allocOrThrow(sz);
+}
+
+void *	operator new[](std::size_t sz)
+{
+	return allocOrThrow(sz);
+}
+
+void *	operator new(std::size_t sz, const std::nothrow_t &) noexcept
+{
+	return allocNoThrow(sz);
+}
+
+void *	operator new[](std::size_t sz, const std::nothrow_t &) noexcept
+{
+	return allocNoThrow(sz);
+}
+
+void *	operator new(std::size_t sz, std::align_val_t alignment)
+{
+	return allocAlignedOrThrow(sz, alignment);
+}
+
+void *	operator new[](std::size_t sz, std::align_val_t alignment)
+{
+	return allocAlignedOrThrow(sz, alignment);
+}
+
+void *	operator new(std::size_t sz, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return allocAlignedNoThrow(sz, alignment);
+}
+
+void *	operator new[](std::size_t sz, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return allocAlignedNoThrow(sz, alignment);
+}
+
+void	operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void	operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void	operator delete(void *p, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void	operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void	operator delete(void *p, std::size_t sz) noexcept
+{
+	free_sized(p, sz);
+}
+
+void	operator delete[](void *p, std::size_t sz) noexcept
+{
+	free_sized(p, sz);
+}
+
+void	operator delete(void *p, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+void	operator delete[](void *p, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+void	operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void	operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void	operator delete(void *p, std::size_t sz, std::align_val_t alignment) noexcept
+{
+	free_aligned_sized(p, static_cast<std::size_t>(alignment), sz ? sz : 1);
+}
+
+void	operator delete[](void *p, std::size_t sz, std::align_val_t alignment) noexcept
+{
+	free_aligned_sized(p, static_cast<std::size_t>(alignment), sz ? sz : 1);
+}
@@ -0,0 +1,111 @@
+#ifndef __MTMM_SNAPSHOT__H__
+#define __MTMM_SNAPSHOT__H__
+
+#include <stdint.h>
+
+/*
+
+The layout of a heap snapshot, as written by mtmm_snapshot() and read by mtmm_analyze. A snapshot is a sequence of
+records in the byte order of the machine that wrote it. Every record starts with its type and its size in bytes, so
+a reader skips records it doesn't know and a newer writer may make records longer. First comes a header record, then
+one record for each heap, size class, superblock and medium chunk, and last an end record - a snapshot without one was cut short.
+*/
+#define MTMM_SNAPSHOT_MAGIC			0x50414e534d4d544dULL	/* "MTMMSNAP" */
+#define MTMM_SNAPSHOT_VERSION		1
+
+#define MTMM_SNAP_HEADER			1
+#define MTMM_SNAP_HEAP				2
+#define MTMM_SNAP_SUPERBLOCK		3
+#define MTMM_SNAP_MEDIUM_CHUNK		4
+#define MTMM_SNAP_END				5
+#define MTMM_SNAP_SIZE_CLASS		6
+
+/* superblock states */
+#define MTMM_SNAP_IDLE				1		/* completely empty, in the global heap's empty pool */
+#define MTMM_SNAP_PURGED			2		/* its memory went back to the OS */
+#define MTMM_SNAP_LENT				4		/* taken out of the heaps by an arena or an object cache */
+
+typedef struct sMtmmSnapRecord
+{
+	uint32_t		type;
+	uint32_t		size;
+} tMtmmSnapRecord;
+
+typedef struct sMtmmSnapHeader
+{
+	tMtmmSnapRecord	record;
+	uint64_t		magic;
+	uint32_t		version;
+	uint32_t		numHeaps;				/* including the global heap, heap 0 */
+	uint32_t		numSizeClasses;			/* class c holds blocks of 1 << c bytes */
+	uint32_t		blockHeaderSize;		/* in front of every block */
+	uint64_t		regionSize;
+	uint64_t		hoardThreshold;			/* smaller objects come from superblocks */
+	uint64_t		mmapThreshold;			/* this size and bigger get their own mmap, the rest are medium blocks */
+	uint64_t		mediumChunkSize;
+	uint64_t		mediumUnitSize;			/* the smallest medium block */
+	uint64_t		footprint;				/* memory mapped from the OS and not purged */
+	uint64_t		numRegions;
+	uint64_t		numFreeMediumChunks;	/* purged chunks no heap holds */
+	uint64_t		numLargeChunks;
+	uint64_t		largeChunkBytes;
+	uint32_t		numNodes;				/* NUMA nodes the heaps are split between, 1 if not */
+	uint32_t		reserved;
+} tMtmmSnapHeader;
+
+typedef struct sMtmmSnapHeap
+{
+	tMtmmSnapRecord	record;
+	uint32_t		heap;
+	uint32_t		numThreads;
+	uint64_t		memoryInUse;			/* u and a of the emptiness invariant */
+	uint64_t		memoryHeld;
+	uint32_t		emptyThresholdK;
+	uint32_t		numEmptyMediumChunks;
+	double			fullnessF;
+	uint32_t		node;					/* NUMA node of the heap */
+	uint32_t		reserved;
+} tMtmmSnapHeap;
+
+/* only for the size classes that were ever used */
+typedef struct sMtmmSnapSizeClass
+{
+	tMtmmSnapRecord	record;
+	uint32_t		sizeClass;
+	uint32_t		reserved;
+	uint64_t		numBlocksOut;			/* blocks out of their superblocks - in use or parked in cpu caches */
+	uint64_t		peakBlocksOut;			/* the most there ever were at once */
+} tMtmmSnapSizeClass;
+
+typedef struct sMtmmSnapSuperblock
+{
+	tMtmmSnapRecord	record;
+	uint32_t		index;
+	uint32_t		ownerHeap;
+	uint32_t		sizeClass;				/* numSizeClasses for a completely empty superblock of no class yet */
+	uint32_t		spanOrder;				/* log2 of the superblock size */
+	uint32_t		numBlocks;
+	uint32_t		numFreeBlocks;			/* blocks parked in cpu caches are not free */
+	uint32_t		numCachedBlocks;		/* of the blocks in use, those parked in cpu caches */
+	uint32_t		state;					/* MTMM_SNAP_IDLE, MTMM_SNAP_PURGED, MTMM_SNAP_LENT */
+	uint64_t		requestedBytes;			/* what malloc was asked for, summed over the blocks in use */
+	uint32_t		node;					/* NUMA node its memory is on - remote if not the owner heap's */
+	uint32_t		reserved;
+} tMtmmSnapSuperblock;
+
+typedef struct sMtmmSnapMediumChunk
+{
+	tMtmmSnapRecord	record;
+	uint32_t		ownerHeap;
+	uint32_t		numFreeUnits;			/* free memory in units of mediumUnitSize */
+	uint32_t		largestFreeUnits;		/* the biggest free block */
+	uint32_t		reserved;
+} tMtmmSnapMediumChunk;
+
+typedef struct sMtmmSnapEnd
+{
+	tMtmmSnapRecord	record;
+	uint64_t		numRecords;				/* written before this one, the header included */
+} tMtmmSnapEnd;
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * perfcounters.h - per-thread perf_event_open counters for the benchmarks.
+ *
+ * Each benchmark thread opens its own set of counters (pid 0, any cpu), so
+ * they follow the thread wherever it runs and count user and kernel work
+ * alike - page faults and the mmap calls behind createSuperblock and
+ * allocateLargeMemoryChunk show up in the counts. With perf_event_paranoid
+ * at 2 the kernel only lets us count user space; such counters are marked
+ * "user space only" in the output. A counter the kernel won't give us at
+ * all (no PMU in a VM, perf_event_paranoid 3, no tracefs) is just reported
+ * as n/a; the benchmark runs the same either way.
+ *
+ *   tPerfCounters pc;
+ *   perfCountersOpen(&pc);
+ *   perfCountersStart(&pc);
+ *   ... timed loop ...
+ *   perfCountersStop(&pc);
+ *   perfCountersClose(&pc);
+ *
+ * and perfCountersPrint() sums the threads' counts and prints them per
+ * operation. Set PERF_COUNTERS=0 in the environment to skip them.
+ */
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+enum
+{
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_DTLB_MISSES,
+	PERF_PAGE_FAULTS,
+	PERF_CONTEXT_SWITCHES,
+	PERF_SYSCALLS,
+	NUM_PERF_COUNTERS
+};
+
+static const char * const s_perfCounterNames[NUM_PERF_COUNTERS] =
+{
+	"cycles", "instructions", "L1d misses", "LLC misses", "dTLB misses", "page faults", "context switches", "syscalls"
+};
+
+typedef struct sPerfCounters
+{
+	int					fd[NUM_PERF_COUNTERS];
+	/* the counts after perfCountersStop, scaled up if the kernel had to multiplex the counter. -1 if not available */
+	double				count[NUM_PERF_COUNTERS];
+	/* 1 if the kernel would only count user space for us */
+	int					isUserOnly[NUM_PERF_COUNTERS];
+} tPerfCounters;
+
+static int perfCountersEnabled(void)
+{
+	const char			*pEnv = getenv("PERF_COUNTERS");
+
+	return !pEnv || strcmp(pEnv, "0");
+}
+
+#ifdef __linux__
+
+/* the tracepoint id of raw_syscalls:sys_enter, which counts every syscall. 0 if tracefs isn't mounted or readable */
+static unsigned long long perfSyscallTracepoint(void)
+{
+	static const char * const paths[] =
+	{
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+	};
+	unsigned long long	id = 0;
+	unsigned int		i;
+
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]) && !id; i++)
+	{
+		FILE				*pFile = fopen(paths[i], "r");
+
+		if (pFile)
+		{
+			if (1 != fscanf(pFile, "%llu", &id))
+			{
+				id = 0;
+			}
+			fclose(pFile);
+		}
+	}
+	return id;
+}
+
+/* open a counter of user and kernel work. If we aren't allowed to count the kernel, count user space alone and say so in *pIsUserOnly */
+static int perfOpenCounter(unsigned int type, unsigned long long config, int *pIsUserOnly)
+{
+	struct perf_event_attr	attr;
+	int					fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	*pIsUserOnly = 0;
+	fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0 && (EACCES == errno || EPERM == errno))
+	{
+		attr.exclude_kernel = 1;
+		fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		*pIsUserOnly = (fd >= 0);
+	}
+	return fd;
+}
+
+#define PERF_CACHE_MISS(cache)	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* open this thread's counters. Counters that can't be opened stay at fd -1 */
+static void perfCountersOpen(tPerfCounters *pCounters)
+{
+	unsigned long long	syscallId;
+	unsigned int		i;
+
+	for (i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		pCounters->fd[i] = -1;
+		pCounters->count[i] = -1;
+		pCounters->isUserOnly[i] = 0;
+	}
+	if (!perfCountersEnabled())
+	{
+		return;
+	}
+	pCounters->fd[PERF_CYCLES] = perfOpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &pCounters->isUserOnly[PERF_CYCLES]);
+	pCounters->fd[PERF_INSTRUCTIONS] = perfOpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, &pCounters->isUserOnly[PERF_INSTRUCTIONS]);
+	pCounters->fd[PERF_L1D_MISSES] = perfOpenCounter(PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), &pCounters->isUserOnly[PERF_L1D_MISSES]);
+	pCounters->fd[PERF_LLC_MISSES] = perfOpenCounter(PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL), &pCounters->isUserOnly[PERF_LLC_MISSES]);
+	pCounters->fd[PERF_DTLB_MISSES] = perfOpenCounter(PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), &pCounters->isUserOnly[PERF_DTLB_MISSES]);
+	pCounters->fd[PERF_PAGE_FAULTS] = perfOpenCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, &pCounters->isUserOnly[PERF_PAGE_FAULTS]);
+	pCounters->fd[PERF_CONTEXT_SWITCHES] = perfOpenCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, &pCounters->isUserOnly[PERF_CONTEXT_SWITCHES]);
+	syscallId = perfSyscallTracepoint();
+	if (syscallId)
+	{
+		pCounters->fd[PERF_SYSCALLS] = perfOpenCounter(PERF_TYPE_TRACEPOINT, syscallId, &pCounters->isUserOnly[PERF_SYSCALLS]);
+	}
+}
+
+static void perfCountersStart(tPerfCounters *pCounters)
+{
+	unsigned int		i;
+
+	for (i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		if (pCounters->fd[i] >= 0)
+		{
+			ioctl(pCounters->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(pCounters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+static void perfCountersStop(tPerfCounters *pCounters)
+{
+	unsigned long long	values[3]; /* count, time enabled, time running */
+	unsigned int		i;
+
+	for (i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		if (pCounters->fd[i] >= 0)
+		{
+			ioctl(pCounters->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+	for (i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		if (pCounters->fd[i] < 0 || sizeof(values) != read(pCounters->fd[i], values, sizeof(values)))
+		{
+			continue;
+		}
+		if (values[2])
+		{
+			pCounters->count[i] = (double)values[0] * values[1] / values[2];
+		}
+	}
+}
+
+static void perfCountersClose(tPerfCounters *pCounters)
+{
+	unsigned int		i;
+
+	for (i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		if (pCounters->fd[i] >= 0)
+		{
+			close(pCounters->fd[i]);
+			pCounters->fd[i] = -1;
+		}
+	}
+}
+
+#else
+
+static void perfCountersOpen(tPerfCounters *pCounters)
+{
+	unsigned int		i;
+
+	for (i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		pCounters->fd[i] = -1;
+		pCounters->count[i] = -1;
+		pCounters->isUserOnly[i] = 0;
+	}
+}
+
+static void perfCountersStart(tPerfCounters *pCounters) { (void)pCounters; }
+static void perfCountersStop(tPerfCounters *pCounters) { (void)pCounters; }
+static void perfCountersClose(tPerfCounters *pCounters) { (void)pCounters; }
+
+#endif
+
+/* sum the counters of numThreads threads and print them per operation. A counter is n/a if any thread couldn't count it,
+and user space only if any thread could count nothing else */
+static void perfCountersPrint(const tPerfCounters *pCounters, unsigned int numThreads, double numOperations)
+{
+	unsigned int		i;
+	unsigned int		t;
+
+	if (!perfCountersEnabled())
+	{
+		return;
+	}
+	printf("Per operation (%.0f operations):\n", numOperations);
+	for (i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		double				sum = 0;
+		int					isUserOnly = 0;
+
+		for (t = 0; t < numThreads && sum >= 0; t++)
+		{
+			sum = pCounters[t].count[i] < 0 ? -1 : sum + pCounters[t].count[i];
+			isUserOnly |= pCounters[t].isUserOnly[i];
+		}
+		if (sum < 0 || numOperations <= 0)
+		{
+			printf("  %-18s n/a\n", s_perfCounterNames[i]);
+		}
+		else
+		{
+			printf("  %-18s %.4f%s\n", s_perfCounterNames[i], sum / numOperations, isUserOnly ? " (user space only)" : "");
+		}
+	}
+}
+
+#endif /* PERFCOUNTERS_H */